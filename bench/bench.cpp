@@ -0,0 +1,557 @@
+/*
+ *  Benchmarks for pitifful on synthetic TIFFs.
+ *
+ *  Generates files that vary one axis at a time away from a base case
+ *  (bit depth, rows per strip, compression, frame count, frame size), or
+ *  every combination of them with --full, and measures for each file:
+ *
+ *      open        constructing a TIFFReader, which parses every IFD
+ *      read_frame  reading every frame in order on one thread
+ *      stack       reading every frame in parallel, as read_stack does
+ *      libtiff     the same open and sequential read with libtiff, when
+ *                  built with USE_LIBTIFF=1
+ *
+ *  Each timing is the best of --repeats runs, with the file in the page
+ *  cache. Results are printed as a table and optionally written as JSON
+ *  (--json PATH) for comparison between releases.
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <pitifful.h>
+#include <pitifful_threads.h>
+#include <pitifful_writer.h>
+#if defined(PITIFFUL_BENCH_LIBTIFF)
+#include <tiffio.h>
+#endif
+
+using namespace pitifful;
+
+// Version of the JSON layout written by --json
+static const int RESULTS_SCHEMA = 1;
+
+// rows_per_strip value meaning "one strip per frame"
+static const int WHOLE_FRAME = -1;
+
+
+/*
+ *  struct: BenchCase
+ *  -----------------
+ *  Layout of one synthetic file. bits_per_sample 32 is written as
+ *  floating point; 8 and 16 as unsigned integers.
+*/
+struct BenchCase {
+    int bits_per_sample;
+    int rows_per_strip;
+    int compression;
+    int n_frames;
+    int size;
+
+    std::string name() const{
+        return (bits_per_sample==32 ? std::string("f32") : std::string("u") + std::to_string(bits_per_sample))
+            + "_rps" + (rows_per_strip==WHOLE_FRAME ? std::string("all") : std::to_string(rows_per_strip))
+            + (compression==COMPRESSION_DEFLATE ? "_deflate" : "_none")
+            + "_f" + std::to_string(n_frames)
+            + "_" + std::to_string(size) + "x" + std::to_string(size);
+    }
+};
+
+
+/*
+ *  struct: BenchResult
+ *  -------------------
+ *  Timings (in seconds) for one BenchCase. write_s is negative when an
+ *  existing file was reused, and the libtiff timings when libtiff was
+ *  not measured.
+*/
+struct BenchResult {
+    BenchCase bench_case;
+    uint64_t file_bytes;
+    uint64_t frame_bytes;
+    double write_s;
+    double open_s;
+    double read_frame_s;
+    double stack_s;
+    double libtiff_open_s = -1;
+    double libtiff_read_s = -1;
+};
+
+
+/*
+ *  struct: BenchOptions
+ *  --------------------
+ *  Command line settings
+*/
+struct BenchOptions {
+    bool full = false;
+    bool quick = false;
+    bool clean = false;
+    int repeats = 3;
+    int n_threads = 0;
+    std::string dir;
+    std::string json_path;
+};
+
+
+/*
+ *  Function: best_of
+ *  -----------------
+ *  Run *fn* once to warm up, then *repeats* more times, and return the
+ *  shortest wall time in seconds.
+*/
+double best_of(int repeats, const std::function<void()>& fn){
+    fn();
+    double best = 0;
+    for(int i=0; i<repeats; ++i){
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if((i==0) || (elapsed.count()<best)){
+            best = elapsed.count();
+        }
+    }
+    return best;
+}
+
+
+/*
+ *  Function: synthetic_frame
+ *  -------------------------
+ *  Fill *out* with a smooth gradient plus a little hashed noise, which
+ *  compresses about as well as typical microscopy data. bench.py makes
+ *  the same frames, so either program can reuse the other's files.
+ *
+ *  Parameters
+ *  ----------
+ *      frame   :   index of the frame in the file
+ *      size    :   frame height and width
+ *      out     :   *size* x *size* samples
+*/
+template <typename T>
+void synthetic_frame(int frame, int size, T* out){
+    const uint32_t range = sizeof(T)==1 ? 248 : 4000;
+    for(uint32_t y=0; y<static_cast<uint32_t>(size); ++y){
+        for(uint32_t x=0; x<static_cast<uint32_t>(size); ++x){
+            const uint32_t hash = (x * 73856093u) ^ (y * 19349663u)
+                ^ (static_cast<uint32_t>(frame) * 83492791u);
+            out[static_cast<size_t>(y) * size + x] = static_cast<T>(
+                (x + 2 * y + 5 * static_cast<uint32_t>(frame)) % range + ((hash >> 7) & 7)
+            );
+        }
+    }
+}
+
+
+/*
+ *  Function: write_case
+ *  --------------------
+ *  Write the synthetic file for *bench_case* to *path*.
+*/
+template <typename T>
+void write_case(const BenchCase& bench_case, const std::string& path){
+    WriterOptions options;
+    options.compression = bench_case.compression;
+    options.n_threads = 0;
+    options.rows_per_strip = bench_case.rows_per_strip==WHOLE_FRAME
+        ? bench_case.size : bench_case.rows_per_strip;
+    TIFFWriter writer(path.c_str(), options);
+    std::vector<T> frame(static_cast<size_t>(bench_case.size) * bench_case.size);
+    for(int i=0; i<bench_case.n_frames; ++i){
+        synthetic_frame<T>(i, bench_case.size, frame.data());
+        writer.write_frame<T>(frame.data(), bench_case.size, bench_case.size);
+    }
+    writer.close();
+}
+
+
+/*
+ *  Function: check_read
+ *  --------------------
+ *  Throw if the last frame of the file does not read back as written,
+ *  so that a broken build cannot report good numbers.
+*/
+template <typename T>
+void check_read(const BenchCase& bench_case, TIFFReader& reader){
+    const size_t n = static_cast<size_t>(bench_case.size) * bench_case.size;
+    std::vector<T> expected(n);
+    std::vector<T> actual(n);
+    synthetic_frame<T>(bench_case.n_frames - 1, bench_case.size, expected.data());
+    reader.read_frame<T>(bench_case.n_frames - 1, actual.data());
+    if(std::memcmp(expected.data(), actual.data(), n * sizeof(T))!=0){
+        throw std::runtime_error(bench_case.name() + std::string(" did not read back as written"));
+    }
+}
+
+
+#if defined(PITIFFUL_BENCH_LIBTIFF)
+/*
+ *  Function: libtiff_open
+ *  ----------------------
+ *  Open *path* with libtiff and walk every directory, which is what
+ *  TIFFReader's constructor does. Returns the number of directories.
+*/
+int libtiff_open(const std::string& path){
+    TIFF* tif = TIFFOpen(path.c_str(), "r");
+    if(tif==nullptr){
+        throw std::runtime_error(std::string("libtiff could not open ") + path);
+    }
+    const int n_directories = TIFFNumberOfDirectories(tif);
+    TIFFClose(tif);
+    return n_directories;
+}
+
+/*
+ *  Function: libtiff_read
+ *  ----------------------
+ *  Read every strip of every frame of *path* in order with libtiff.
+*/
+void libtiff_read(const std::string& path, std::vector<char>& buffer){
+    TIFF* tif = TIFFOpen(path.c_str(), "r");
+    if(tif==nullptr){
+        throw std::runtime_error(std::string("libtiff could not open ") + path);
+    }
+    do{
+        const uint32_t n_strips = TIFFNumberOfStrips(tif);
+        const tmsize_t strip_size = TIFFStripSize(tif);
+        if(buffer.size()<static_cast<size_t>(strip_size)){
+            buffer.resize(strip_size);
+        }
+        for(uint32_t strip=0; strip<n_strips; ++strip){
+            if(TIFFReadEncodedStrip(tif, strip, buffer.data(), strip_size)<0){
+                TIFFClose(tif);
+                throw std::runtime_error(std::string("libtiff could not read ") + path);
+            }
+        }
+    } while(TIFFReadDirectory(tif));
+    TIFFClose(tif);
+}
+#endif
+
+
+/*
+ *  Function: run_case
+ *  ------------------
+ *  Write the file for *bench_case* if it does not exist yet, then time
+ *  opening and reading it.
+*/
+template <typename T>
+BenchResult run_case(const BenchCase& bench_case, const BenchOptions& options){
+    BenchResult result;
+    result.bench_case = bench_case;
+    const std::string path = options.dir + "/" + bench_case.name() + ".tif";
+
+    struct stat file_stat;
+    result.write_s = -1;
+    if(stat(path.c_str(), &file_stat)!=0){
+        const auto start = std::chrono::steady_clock::now();
+        write_case<T>(bench_case, path);
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        result.write_s = elapsed.count();
+        if(stat(path.c_str(), &file_stat)!=0){
+            throw std::runtime_error(std::string("could not write ") + path);
+        }
+    }
+    result.file_bytes = static_cast<uint64_t>(file_stat.st_size);
+    const size_t frame_samples = static_cast<size_t>(bench_case.size) * bench_case.size;
+    result.frame_bytes = frame_samples * sizeof(T);
+
+    result.open_s = best_of(options.repeats, [&](){TIFFReader reader(path.c_str());});
+
+    TIFFReader reader(path.c_str());
+    check_read<T>(bench_case, reader);
+
+    std::vector<T> frame(frame_samples);
+    result.read_frame_s = best_of(options.repeats, [&](){
+        for(int i=0; i<bench_case.n_frames; ++i){
+            reader.read_frame<T>(i, frame.data());
+        }
+    });
+
+    std::vector<T> stack(frame_samples * bench_case.n_frames);
+    ThreadPool pool(std::min(options.n_threads, bench_case.n_frames));
+    result.stack_s = best_of(options.repeats, [&](){
+        pool.parallel_for(static_cast<size_t>(bench_case.n_frames), [&](size_t i){
+            reader.read_frame<T>(static_cast<int>(i), stack.data() + i * frame_samples);
+        });
+    });
+
+#if defined(PITIFFUL_BENCH_LIBTIFF)
+    result.libtiff_open_s = best_of(options.repeats, [&](){libtiff_open(path);});
+    std::vector<char> buffer;
+    result.libtiff_read_s = best_of(options.repeats, [&](){libtiff_read(path, buffer);});
+#endif
+
+    if(options.clean){
+        std::remove(path.c_str());
+    }
+    return result;
+}
+
+BenchResult run_case(const BenchCase& bench_case, const BenchOptions& options){
+    switch(bench_case.bits_per_sample){
+        case 8:
+            return run_case<uint8_t>(bench_case, options);
+        case 16:
+            return run_case<uint16_t>(bench_case, options);
+        case 32:
+            return run_case<float>(bench_case, options);
+        default:
+            throw std::runtime_error(
+                std::string("no benchmark for ") + std::to_string(bench_case.bits_per_sample)
+                + std::string("-bit samples")
+            );
+    }
+}
+
+
+/*
+ *  Function: make_cases
+ *  --------------------
+ *  The cases to run: the base case plus every other value of each axis
+ *  on its own, or with *full* every combination of the axis values.
+ *  *quick* leaves out the largest files.
+*/
+std::vector<BenchCase> make_cases(bool full, bool quick){
+    const std::vector<int> bits{16, 8, 32};
+    const std::vector<int> rows_per_strip{0, 1, 16, WHOLE_FRAME};
+    const std::vector<int> compression{COMPRESSION_NONE, COMPRESSION_DEFLATE};
+    std::vector<int> n_frames{64, 8, 512};
+    std::vector<int> sizes{512, 64, 1024};
+    if(quick){
+        n_frames.pop_back();
+        sizes.pop_back();
+    }
+
+    // The first value of each axis is the base case
+    std::vector<BenchCase> cases;
+    if(full){
+        for(int b : bits) for(int r : rows_per_strip) for(int c : compression)
+        for(int f : n_frames) for(int s : sizes){
+            cases.push_back(BenchCase{b, r, c, f, s});
+        }
+        return cases;
+    }
+    const BenchCase base{bits[0], rows_per_strip[0], compression[0], n_frames[0], sizes[0]};
+    cases.push_back(base);
+    for(size_t i=1; i<bits.size(); ++i){
+        BenchCase c = base; c.bits_per_sample = bits[i]; cases.push_back(c);
+    }
+    for(size_t i=1; i<rows_per_strip.size(); ++i){
+        BenchCase c = base; c.rows_per_strip = rows_per_strip[i]; cases.push_back(c);
+    }
+    for(size_t i=1; i<compression.size(); ++i){
+        BenchCase c = base; c.compression = compression[i]; cases.push_back(c);
+    }
+    for(size_t i=1; i<n_frames.size(); ++i){
+        BenchCase c = base; c.n_frames = n_frames[i]; cases.push_back(c);
+    }
+    for(size_t i=1; i<sizes.size(); ++i){
+        BenchCase c = base; c.size = sizes[i]; cases.push_back(c);
+    }
+    return cases;
+}
+
+
+/*
+ *  Function: throughput
+ *  --------------------
+ *  Decoded megabytes per second for reading *n_frames* frames of
+ *  *frame_bytes* each in *seconds*.
+*/
+double throughput(const BenchResult& result, double seconds){
+    return seconds>0
+        ? static_cast<double>(result.frame_bytes) * result.bench_case.n_frames / seconds / 1e6
+        : 0;
+}
+
+
+/*
+ *  Function: json_number
+ *  ---------------------
+ *  *value* as a JSON number, or null if it is negative (not measured)
+*/
+std::string json_number(double value){
+    if(value<0){
+        return "null";
+    }
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.9g", value);
+    return buffer;
+}
+
+
+/*
+ *  Function: write_json
+ *  --------------------
+ *  Write *results* to *path* as a JSON document with one object per
+ *  case, plus the build settings that affect the numbers.
+*/
+void write_json(
+    const std::string& path,
+    const BenchOptions& options,
+    const std::vector<BenchResult>& results
+){
+    std::ofstream out(path);
+    if(!out){
+        throw std::runtime_error(std::string("could not open ") + path);
+    }
+    char timestamp[32];
+    const std::time_t now = std::time(nullptr);
+    std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+
+    out << "{\n";
+    out << "  \"schema\": " << RESULTS_SCHEMA << ",\n";
+    out << "  \"timestamp\": \"" << timestamp << "\",\n";
+    out << "  \"compiler\": \"" << __VERSION__ << "\",\n";
+    out << "  \"repeats\": " << options.repeats << ",\n";
+    out << "  \"n_threads\": " << options.n_threads << ",\n";
+    out << "  \"features\": {";
+#if defined(PITIFFUL_USE_LIBDEFLATE)
+    out << "\"libdeflate\": true, ";
+#else
+    out << "\"libdeflate\": false, ";
+#endif
+#if defined(PITIFFUL_HAVE_ZSTD)
+    out << "\"zstd\": true, ";
+#else
+    out << "\"zstd\": false, ";
+#endif
+#if defined(PITIFFUL_IO_URING)
+    out << "\"io_uring\": true, ";
+#else
+    out << "\"io_uring\": false, ";
+#endif
+#if defined(PITIFFUL_BENCH_LIBTIFF)
+    const std::string libtiff_version = TIFFGetVersion();
+    out << "\"libtiff\": \"" << libtiff_version.substr(0, libtiff_version.find('\n')) << "\"";
+#else
+    out << "\"libtiff\": null";
+#endif
+    out << "},\n";
+    out << "  \"results\": [\n";
+    for(size_t i=0; i<results.size(); ++i){
+        const BenchResult& r = results[i];
+        const BenchCase& c = r.bench_case;
+        out << "    {";
+        out << "\"name\": \"" << c.name() << "\", ";
+        out << "\"bits_per_sample\": " << c.bits_per_sample << ", ";
+        out << "\"sample_format\": \"" << (c.bits_per_sample==32 ? "float" : "uint") << "\", ";
+        out << "\"rows_per_strip\": " << (c.rows_per_strip==WHOLE_FRAME ? c.size : c.rows_per_strip) << ", ";
+        out << "\"compression\": \"" << (c.compression==COMPRESSION_DEFLATE ? "deflate" : "none") << "\", ";
+        out << "\"n_frames\": " << c.n_frames << ", ";
+        out << "\"height\": " << c.size << ", ";
+        out << "\"width\": " << c.size << ", ";
+        out << "\"file_bytes\": " << r.file_bytes << ", ";
+        out << "\"frame_bytes\": " << r.frame_bytes << ", ";
+        out << "\"write_s\": " << json_number(r.write_s) << ", ";
+        out << "\"open_s\": " << json_number(r.open_s) << ", ";
+        out << "\"read_frame_s\": " << json_number(r.read_frame_s) << ", ";
+        out << "\"read_frame_mb_s\": " << json_number(throughput(r, r.read_frame_s)) << ", ";
+        out << "\"read_frame_us_per_frame\": " << json_number(r.read_frame_s * 1e6 / c.n_frames) << ", ";
+        out << "\"stack_s\": " << json_number(r.stack_s) << ", ";
+        out << "\"stack_mb_s\": " << json_number(throughput(r, r.stack_s)) << ", ";
+        out << "\"libtiff_open_s\": " << json_number(r.libtiff_open_s) << ", ";
+        out << "\"libtiff_read_s\": " << json_number(r.libtiff_read_s) << ", ";
+        out << "\"libtiff_read_mb_s\": "
+            << json_number(r.libtiff_read_s<0 ? -1 : throughput(r, r.libtiff_read_s));
+        out << "}" << (i+1<results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n";
+    out << "}\n";
+}
+
+
+void print_usage(){
+    std::cerr << "usage: bench [--quick] [--full] [--repeats N] [--threads N]\n"
+              << "             [--dir DIR] [--clean] [--json PATH]\n"
+              << "\n"
+              << "  --quick       one repeat, and leave out the largest files\n"
+              << "  --full        every combination of the axes, not one axis at a time\n"
+              << "  --repeats N   report the best of N runs of each timing (default 3)\n"
+              << "  --threads N   threads for the stack read (default: one per core)\n"
+              << "  --dir DIR     where synthetic files are written and reused\n"
+              << "                (default: $TMPDIR/pitifful_bench)\n"
+              << "  --clean       delete each synthetic file after its case\n"
+              << "  --json PATH   also write the results to PATH as JSON\n";
+}
+
+
+int main(int argc, char* argv[]){
+    BenchOptions options;
+    for(int i=1; i<argc; ++i){
+        const std::string arg = argv[i];
+        const bool has_value = i+1<argc;
+        if(arg=="--quick"){
+            options.quick = true;
+            options.repeats = 1;
+        } else if(arg=="--full"){
+            options.full = true;
+        } else if(arg=="--clean"){
+            options.clean = true;
+        } else if((arg=="--repeats") && has_value){
+            options.repeats = std::max(1, std::atoi(argv[++i]));
+        } else if((arg=="--threads") && has_value){
+            options.n_threads = std::atoi(argv[++i]);
+        } else if((arg=="--dir") && has_value){
+            options.dir = argv[++i];
+        } else if((arg=="--json") && has_value){
+            options.json_path = argv[++i];
+        } else{
+            print_usage();
+            return 1;
+        }
+    }
+    if(options.n_threads<=0){
+        options.n_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    }
+    if(options.dir.empty()){
+        const char* tmpdir = std::getenv("TMPDIR");
+        options.dir = std::string(tmpdir ? tmpdir : "/tmp") + "/pitifful_bench";
+    }
+    mkdir(options.dir.c_str(), 0755);
+
+    std::vector<BenchResult> results;
+    std::printf(
+        "%-32s %9s %9s %11s %11s %11s %11s\n",
+        "case", "MB", "open ms", "frame MB/s", "us/frame", "stack MB/s", "libtiff MB/s"
+    );
+    try{
+        for(const BenchCase& bench_case : make_cases(options.full, options.quick)){
+            const BenchResult r = run_case(bench_case, options);
+            results.push_back(r);
+            std::printf(
+                "%-32s %9.1f %9.3f %11.1f %11.1f %11.1f %11s\n",
+                bench_case.name().c_str(),
+                r.file_bytes / 1e6,
+                r.open_s * 1e3,
+                throughput(r, r.read_frame_s),
+                r.read_frame_s * 1e6 / bench_case.n_frames,
+                throughput(r, r.stack_s),
+                r.libtiff_read_s<0 ? "-" : std::to_string(
+                    static_cast<int>(throughput(r, r.libtiff_read_s))
+                ).c_str()
+            );
+            std::fflush(stdout);
+        }
+        if(!options.json_path.empty()){
+            write_json(options.json_path, options, results);
+        }
+    } catch(const std::exception& e){
+        std::cerr << "bench: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,249 @@
+"""
+Benchmarks for the pitifful Python bindings on synthetic TIFFs.
+
+Runs the same cases as bench.cpp, on the same files (pass the same
+--dir to reuse them), and measures for each file:
+
+    open            constructing a TIFFReader
+    read_frame      reading every frame in order into one out= buffer
+    read_frame_new  the same, allocating a new array for every frame
+    stack           read_stack on --threads threads
+    tifffile        tifffile.imread of the whole file, when installed
+
+Given the JSON written by `bench --json`, also reports the binding
+overhead per read_frame call: the Python time per frame minus the C++
+time per frame for the same file.
+
+Usage:
+    python bench.py [--quick] [--full] [--repeats N] [--threads N]
+                    [--dir DIR] [--cpp-results PATH] [--json PATH]
+"""
+import argparse
+import itertools
+import json
+import os
+import tempfile
+import time
+import numpy as np
+from pitifful import TIFFReader, TIFFWriter
+
+# Version of the JSON layout written by --json
+RESULTS_SCHEMA = 1
+
+# rows_per_strip value meaning "one strip per frame"
+WHOLE_FRAME = -1
+
+# Axis values, each starting with the base case; must match make_cases()
+# in bench.cpp
+AXES = {
+    "dtype": [np.uint16, np.uint8, np.float32],
+    "rows_per_strip": [0, 1, 16, WHOLE_FRAME],
+    "compression": ["none", "deflate"],
+    "n_frames": [64, 8, 512],
+    "size": [512, 64, 1024],
+}
+
+
+def make_cases(full, quick):
+    """
+    The cases to run: the base case plus every other value of each axis
+    on its own, or with *full* every combination of the axis values.
+    *quick* leaves out the largest files.
+    """
+    axes = {k: list(v) for k, v in AXES.items()}
+    if quick:
+        axes["n_frames"].pop()
+        axes["size"].pop()
+    if full:
+        return [dict(zip(axes, values)) for values in itertools.product(*axes.values())]
+    base = {k: v[0] for k, v in axes.items()}
+    cases = [base]
+    for axis, values in axes.items():
+        cases.extend(dict(base, **{axis: value}) for value in values[1:])
+    return cases
+
+
+def case_name(case):
+    """Name of a case and its file, as in BenchCase::name()"""
+    dtype = np.dtype(case["dtype"])
+    rows = "all" if case["rows_per_strip"] == WHOLE_FRAME else str(case["rows_per_strip"])
+    return "{}{}_rps{}_{}_f{}_{}x{}".format(
+        "f" if dtype.kind == "f" else "u",
+        dtype.itemsize * 8,
+        rows,
+        case["compression"],
+        case["n_frames"],
+        case["size"],
+        case["size"],
+    )
+
+
+def synthetic_frame(frame, size, dtype):
+    """The frame written by synthetic_frame() in bench.cpp"""
+    y, x = np.mgrid[:size, :size].astype(np.uint32)
+    frame_hash = np.uint32((frame * 83492791) & 0xFFFFFFFF)
+    value_range = 248 if np.dtype(dtype).itemsize == 1 else 4000
+    noise = ((x * np.uint32(73856093)) ^ (y * np.uint32(19349663)) ^ frame_hash) >> 7
+    return ((x + 2 * y + np.uint32(5 * frame)) % value_range + (noise & 7)).astype(dtype)
+
+
+def write_case(case, path):
+    """Write the synthetic file for *case* to *path*"""
+    rows = case["size"] if case["rows_per_strip"] == WHOLE_FRAME else case["rows_per_strip"]
+    with TIFFWriter(path, compression=case["compression"], n_threads=0, rows_per_strip=rows) as writer:
+        for frame in range(case["n_frames"]):
+            writer.write_frame(synthetic_frame(frame, case["size"], case["dtype"]))
+
+
+def best_of(repeats, fn):
+    """Run *fn* once to warm up, then *repeats* more times, and return
+    the shortest wall time in seconds"""
+    fn()
+    best = None
+    for _ in range(repeats):
+        start = time.perf_counter()
+        fn()
+        elapsed = time.perf_counter() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+
+def run_case(case, args, tifffile):
+    """Write the file for *case* if it does not exist yet, then time
+    opening and reading it"""
+    path = os.path.join(args.dir, case_name(case) + ".tif")
+    write_s = None
+    if not os.path.exists(path):
+        start = time.perf_counter()
+        write_case(case, path)
+        write_s = time.perf_counter() - start
+
+    n_frames = case["n_frames"]
+    reader = TIFFReader(path)
+    last = reader.read_frame(n_frames - 1)
+    if not np.array_equal(last, synthetic_frame(n_frames - 1, case["size"], case["dtype"])):
+        raise RuntimeError("{} did not read back as written".format(path))
+
+    def read_frames_out():
+        for frame in range(n_frames):
+            reader.read_frame(frame, out=last)
+
+    def read_frames_new():
+        for frame in range(n_frames):
+            reader.read_frame(frame)
+
+    result = {
+        "name": case_name(case),
+        "dtype": np.dtype(case["dtype"]).name,
+        "rows_per_strip": case["size"] if case["rows_per_strip"] == WHOLE_FRAME else case["rows_per_strip"],
+        "compression": case["compression"],
+        "n_frames": n_frames,
+        "height": case["size"],
+        "width": case["size"],
+        "file_bytes": os.path.getsize(path),
+        "frame_bytes": last.nbytes,
+        "write_s": write_s,
+        "open_s": best_of(args.repeats, lambda: TIFFReader(path)),
+        "read_frame_s": best_of(args.repeats, read_frames_out),
+        "read_frame_new_s": best_of(args.repeats, read_frames_new),
+        "stack_s": best_of(args.repeats, lambda: reader.read_stack(n_threads=args.threads)),
+        "tifffile_read_s": None,
+    }
+    if tifffile is not None:
+        result["tifffile_read_s"] = best_of(args.repeats, lambda: tifffile.imread(path))
+    if args.clean:
+        os.remove(path)
+    return result
+
+
+def throughput(result, seconds):
+    """Decoded megabytes per second"""
+    if not seconds:
+        return None
+    return result["frame_bytes"] * result["n_frames"] / seconds / 1e6
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--quick", action="store_true", help="one repeat, and leave out the largest files")
+    parser.add_argument("--full", action="store_true", help="every combination of the axes")
+    parser.add_argument("--repeats", type=int, default=3, help="report the best of N runs of each timing")
+    parser.add_argument("--threads", type=int, default=0, help="threads for read_stack (default: one per core)")
+    parser.add_argument(
+        "--dir",
+        default=os.path.join(tempfile.gettempdir(), "pitifful_bench"),
+        help="where synthetic files are written and reused",
+    )
+    parser.add_argument("--clean", action="store_true", help="delete each synthetic file after its case")
+    parser.add_argument("--cpp-results", help="JSON written by bench --json, to compute binding overhead")
+    parser.add_argument("--no-tifffile", action="store_true", help="do not measure tifffile")
+    parser.add_argument("--json", help="also write the results to this path as JSON")
+    args = parser.parse_args()
+    if args.quick:
+        args.repeats = 1
+    os.makedirs(args.dir, exist_ok=True)
+
+    tifffile = None
+    if not args.no_tifffile:
+        try:
+            import tifffile
+        except ImportError:
+            pass
+
+    cpp_results = {}
+    if args.cpp_results:
+        with open(args.cpp_results) as f:
+            cpp_results = {r["name"]: r for r in json.load(f)["results"]}
+
+    print(
+        "{:<32} {:>9} {:>11} {:>11} {:>11} {:>13} {:>11}".format(
+            "case", "open ms", "frame MB/s", "us/frame", "stack MB/s", "tifffile MB/s", "overhead us"
+        )
+    )
+    results = []
+    for case in make_cases(args.full, args.quick):
+        result = run_case(case, args, tifffile)
+        us_per_frame = result["read_frame_s"] * 1e6 / result["n_frames"]
+        result["read_frame_us_per_frame"] = us_per_frame
+        result["overhead_us_per_frame"] = None
+        if result["name"] in cpp_results:
+            result["overhead_us_per_frame"] = us_per_frame - cpp_results[result["name"]]["read_frame_us_per_frame"]
+        for key in ("read_frame", "read_frame_new", "stack", "tifffile_read"):
+            result[key + "_mb_s"] = throughput(result, result[key + "_s"])
+        results.append(result)
+
+        def show(value, spec):
+            return "-" if value is None else format(value, spec)
+
+        print(
+            "{:<32} {:>9} {:>11} {:>11} {:>11} {:>13} {:>11}".format(
+                result["name"],
+                show(result["open_s"] * 1e3, ".3f"),
+                show(result["read_frame_mb_s"], ".1f"),
+                show(us_per_frame, ".1f"),
+                show(result["stack_mb_s"], ".1f"),
+                show(result["tifffile_read_mb_s"], ".1f"),
+                show(result["overhead_us_per_frame"], ".2f"),
+            ),
+            flush=True,
+        )
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(
+                {
+                    "schema": RESULTS_SCHEMA,
+                    "timestamp": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+                    "repeats": args.repeats,
+                    "n_threads": args.threads,
+                    "numpy": np.__version__,
+                    "tifffile": None if tifffile is None else tifffile.__version__,
+                    "results": results,
+                },
+                f,
+                indent=2,
+            )
+
+
+if __name__ == "__main__":
+    main()
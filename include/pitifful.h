@@ -2,24 +2,48 @@
 #ifndef _PITIFFUL_H
 #define _PITIFFUL_H
 
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <type_traits>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "portable_endian.h"
+#include "pitifful_cache.h"
+#include "pitifful_convert.h"
 #include "pitifful_deflate.h"
+#include "pitifful_io.h"
+#include "pitifful_lzw.h"
+#include "pitifful_packbits.h"
+#include "pitifful_predictor.h"
+#include "pitifful_stats.h"
+#include "pitifful_threads.h"
+#include "pitifful_zstd.h"
 
 namespace pitifful {
 
 /* Indicates no compression */
 static const int COMPRESSION_NONE = 1;
 static const int COMPRESSION_DEFLATE = 8;
+// COMPRESSION_LZW (5) is defined in pitifful_lzw.h
+
+/* Values of the SampleFormat tag (339) */
+static const int SAMPLE_FORMAT_UINT = 1;
+static const int SAMPLE_FORMAT_INT = 2;
+static const int SAMPLE_FORMAT_IEEEFP = 3;
 
 /* Sizes of each TIFF field type in bytes */
-const uint16_t TIFF_FIELD_TYPE_SIZES[12] = {
+const uint16_t TIFF_FIELD_TYPE_SIZES[18] = {
     1,   // type 1 (BYTE): 8-bit unsigned integer
     1,   // type 2 (ASCII): 8-bit byte with a 7-bit ASCII code in the first 7 bits
     2,   // type 3 (SHORT): 16-bit unsigned integer
@@ -31,9 +55,19 @@ const uint16_t TIFF_FIELD_TYPE_SIZES[12] = {
     4,   // type 9 (SLONG): 32-bit signed (twos-complement) integer
     8,   // type 10 (SRATIONAL): rational expressed as two SLONGs
     4,   // type 11 (FLOAT): IEEE single-precision floating point
-    8    // type 12 (DOUBLE): IEEE double-precision floating point
+    8,   // type 12 (DOUBLE): IEEE double-precision floating point
+    4,   // type 13 (IFD): 32-bit unsigned offset of a sub-IFD
+    0,   // type 14: unused
+    0,   // type 15: unused
+    8,   // type 16 (LONG8): 64-bit unsigned integer (BigTIFF)
+    8,   // type 17 (SLONG8): 64-bit signed integer (BigTIFF)
+    8    // type 18 (IFD8): 64-bit unsigned offset of a sub-IFD (BigTIFF)
 };
 
+/* Values of the version field in the TIFF header */
+static const int TIFF_VERSION_CLASSIC = 42;
+static const int TIFF_VERSION_BIG = 43;
+
 /*
  *  Function: determine_if_host_is_little_endian
  *  --------------------------------------------
@@ -61,11 +95,12 @@ struct IFD {
     uint64_t next_byte_offset = 0;
 
     // Total number of fields in this IFD.
-    uint16_t count = 0;
+    uint64_t count = 0;
 
-    // Location and size of each strip.
-    std::vector<uint64_t> strip_offsets, // 273
-                          strip_byte_counts; // 279
+    // Location and size of each strip, or of each tile when the image
+    // is tiled (see is_tiled).
+    std::vector<uint64_t> strip_offsets, // 273 or 324
+                          strip_byte_counts; // 279 or 325
 
     // Image metadata (special TIFF fields).
     int width = -1, // 256
@@ -74,7 +109,11 @@ struct IFD {
         compression = -1, // 259
         photometric_interpretation = -1, // 262
         samples_per_pixel = -1, // 277
-        rows_per_strip = -1; // 278
+        rows_per_strip = -1, // 278
+        predictor = -1, // 317
+        tile_width = -1, // 322
+        tile_length = -1, // 323
+        sample_format = -1; // 339
 };
 
 
@@ -83,15 +122,15 @@ struct IFD {
  *  ------------------------
  *  Return true if a TIFF field has a local value, and false if
  *  its value is located elsewhere in the file. The rule is that
- *  values are local if and only if they fit into 4 bytes
- *  (TIFF6 specification, page 15).
+ *  values are local if and only if they fit into the field's value
+ *  slot: 4 bytes in a classic TIFF (TIFF6 specification, page 15) and
+ *  8 bytes in a BigTIFF.
 */
-inline bool is_local_value(uint16_t field_type, uint16_t count){
-    if((field_type<0) || (field_type>12)){
+inline bool is_local_value(uint16_t field_type, uint64_t count, uint64_t local_size = 4){
+    if((field_type<1) || (field_type>18) || (TIFF_FIELD_TYPE_SIZES[field_type-1]==0)){
         return false;
     }
-    uint16_t field_size = TIFF_FIELD_TYPE_SIZES[field_type-1] * count;
-    return field_size <= 4;
+    return count <= local_size / TIFF_FIELD_TYPE_SIZES[field_type-1];
 }
 
 
@@ -105,7 +144,26 @@ inline bool is_uint_value(uint16_t field_type){
         (field_type==1) ||
         (field_type==2) ||
         (field_type==3) ||
-        (field_type==4)
+        (field_type==4) ||
+        (field_type==13) ||
+        (field_type==16) ||
+        (field_type==18)
+    );
+}
+
+
+/*
+ *  Function: is_offset_value
+ *  -------------------------
+ *  Return true if a TIFF field has a type allowed for strip/tile offsets
+ *  and byte counts (BYTE, SHORT, LONG, or LONG8).
+*/
+inline bool is_offset_value(uint16_t field_type){
+    return (
+        (field_type==1) ||
+        (field_type==3) ||
+        (field_type==4) ||
+        (field_type==16)
     );
 }
 
@@ -117,28 +175,34 @@ inline bool is_uint_value(uint16_t field_type){
  *
  *  Parameters
  *  ----------
- *    field_type    :   1, 2, 3, or 4, how to interpret this field
+ *    field_type    :   1, 2, 3, 4, 13, 16, or 18, how to interpret this field
  *    c             :   pointer to raw bytes
+ *    swap          :   true if the file's byte order differs from the host's
  *
  *  Returns
  *  -------
  *    cast value
 */
 template <typename T>
-inline T parse_uint_field(uint16_t field_type, char* c){
+inline T parse_uint_field(uint16_t field_type, const char* c, bool swap = false){
     T x;
     switch(field_type){
         case 1:
-            x = static_cast<T>(*reinterpret_cast<uint8_t*>(c));
+            x = static_cast<T>(load_sample<uint8_t>(c, swap));
             break;
         case 2:
-            x = static_cast<T>(*reinterpret_cast<char*>(c));
+            x = static_cast<T>(*reinterpret_cast<const char*>(c));
             break;
         case 3:
-            x = static_cast<T>(*reinterpret_cast<uint16_t*>(c));
+            x = static_cast<T>(load_sample<uint16_t>(c, swap));
             break;
         case 4:
-            x = static_cast<T>(*reinterpret_cast<uint32_t*>(c));
+        case 13:
+            x = static_cast<T>(load_sample<uint32_t>(c, swap));
+            break;
+        case 16:
+        case 18:
+            x = static_cast<T>(load_sample<uint64_t>(c, swap));
             break;
         default:
             std::string err("cannot interpret TIFF tag type as uint: ");
@@ -147,8 +211,8 @@ inline T parse_uint_field(uint16_t field_type, char* c){
     }
     return x;
 }
-template uint32_t parse_uint_field<uint32_t>(uint16_t field_type, char* c);
-template uint64_t parse_uint_field<uint64_t>(uint16_t field_type, char* c);
+template uint32_t parse_uint_field<uint32_t>(uint16_t field_type, const char* c, bool swap);
+template uint64_t parse_uint_field<uint64_t>(uint16_t field_type, const char* c, bool swap);
 
 
 /*
@@ -158,37 +222,49 @@ template uint64_t parse_uint_field<uint64_t>(uint16_t field_type, char* c);
  *
  *  Parameters
  *  ----------
- *    field_type    :   1, 2, 3, 4, 6, 8, or 9, how to interpret this field
+ *    field_type    :   1, 2, 3, 4, 6, 8, 9, 13, 16, 17, or 18, how to
+ *                      interpret this field
  *    c             :   pointer to raw bytes
+ *    swap          :   true if the file's byte order differs from the host's
  *
  *  Returns
  *  -------
  *    cast value
 */
 template <typename T>
-inline T parse_int_field(uint16_t field_type, char* c){
+inline T parse_int_field(uint16_t field_type, const char* c, bool swap = false){
     T x;
     switch(field_type){
         case 1:
-            x = static_cast<T>(*reinterpret_cast<uint8_t*>(c));
+            x = static_cast<T>(load_sample<uint8_t>(c, swap));
             break;
         case 2:
-            x = static_cast<T>(*reinterpret_cast<char*>(c));
+            x = static_cast<T>(*reinterpret_cast<const char*>(c));
             break;
         case 3:
-            x = static_cast<T>(*reinterpret_cast<uint16_t*>(c));
+            x = static_cast<T>(load_sample<uint16_t>(c, swap));
             break;
         case 4:
-            x = static_cast<T>(*reinterpret_cast<uint32_t*>(c));
+            x = static_cast<T>(load_sample<uint32_t>(c, swap));
             break;
         case 6:
-            x = static_cast<T>(*reinterpret_cast<int8_t*>(c));
+            x = static_cast<T>(load_sample<int8_t>(c, swap));
             break;
         case 8:
-            x = static_cast<T>(*reinterpret_cast<int16_t*>(c));
+            x = static_cast<T>(load_sample<int16_t>(c, swap));
             break;
         case 9:
-            x = static_cast<T>(*reinterpret_cast<int32_t*>(c));
+            x = static_cast<T>(load_sample<int32_t>(c, swap));
+            break;
+        case 13:
+            x = static_cast<T>(load_sample<uint32_t>(c, swap));
+            break;
+        case 16:
+        case 18:
+            x = static_cast<T>(load_sample<uint64_t>(c, swap));
+            break;
+        case 17:
+            x = static_cast<T>(load_sample<int64_t>(c, swap));
             break;
         default:
             std::string err("cannot interpret TIFF tag type as uint: ");
@@ -197,15 +273,17 @@ inline T parse_int_field(uint16_t field_type, char* c){
     }
     return x;
 }
-template int parse_int_field<int>(uint16_t field_type, char *c);
-template int64_t parse_int_field<int64_t>(uint16_t field_type, char* c);
+template int parse_int_field<int>(uint16_t field_type, const char* c, bool swap);
+template int64_t parse_int_field<int64_t>(uint16_t field_type, const char* c, bool swap);
 
 
 /*
  *  Function: _parse_array
  *  ----------------------
  *  Parse multiple values of the same type from raw bytes into an output
- *  array.
+ *  array. Byte swapping (when the file and host disagree on endianness)
+ *  is fused with the conversion, and common conversions use SIMD
+ *  kernels (see pitifful_convert.h).
  *
  *  Assumptions
  *  -----------
@@ -227,35 +305,10 @@ inline void _parse_array(
     unsigned count,
     bool host_be,
     bool file_be,
-    char* in,
+    const char* in,
     Tout* out
 ){
-    Tin* ptr = reinterpret_cast<Tin*>(in);
-    if(host_be==file_be){
-        for(unsigned i=0; i<count; ++i){
-            out[i] = static_cast<Tout>(ptr[i]);
-        }
-    } else if((host_be) && (!file_be)){
-        if(std::is_same<Tin, uint16_t>::value){
-            for(unsigned i=0; i<count; ++i){
-                out[i] = static_cast<Tout>(le16toh(ptr[i]));
-            }
-        } else if(std::is_same<Tin, uint32_t>::value){
-            for(unsigned i=0; i<count; ++i){
-                out[i] = static_cast<Tout>(le32toh(ptr[i]));
-            }
-        } else if(std::is_same<Tin, uint64_t>::value){
-            for(unsigned i=0; i<count; ++i){
-                out[i] = static_cast<Tout>(le64toh(ptr[i]));
-            }
-        } else{
-            throw std::runtime_error(
-                "can only parse uint16, uint32, or uint64 from LE to BE"
-            );
-        }
-    } else if((!host_be) && (file_be)){
-        ;
-    }
+    convert_samples<Tin, Tout>(in, out, count, host_be!=file_be);
 }
 
 /*
@@ -270,7 +323,7 @@ inline void parse_array(
     uint32_t count,
     bool host_be,
     bool file_be,
-    char* in,
+    const char* in,
     T* out
 ){
     switch(field_type){
@@ -281,9 +334,10 @@ inline void parse_array(
             _parse_array<uint16_t, T>(count, host_be, file_be, in, out);
             break;
         case 4:
+        case 13:
             _parse_array<uint32_t, T>(count, host_be, file_be, in, out);
             break;
-        case 7:
+        case 6:
             _parse_array<int8_t, T>(count, host_be, file_be, in, out);
             break;
         case 8:
@@ -298,6 +352,13 @@ inline void parse_array(
         case 12:
             _parse_array<double, T>(count, host_be, file_be, in, out);
             break;
+        case 16:
+        case 18:
+            _parse_array<uint64_t, T>(count, host_be, file_be, in, out);
+            break;
+        case 17:
+            _parse_array<int64_t, T>(count, host_be, file_be, in, out);
+            break;
         default:
             throw std::runtime_error(
                 std::string("unrecognized field_type ") + std::to_string(field_type)
@@ -306,236 +367,2184 @@ inline void parse_array(
 }
 
 
+/*
+ *  Function: strip_height
+ *  ----------------------
+ *  Number of image rows stored in each strip of an IFD. RowsPerStrip
+ *  defaults to "the whole image" when absent, and may legally exceed
+ *  the image height.
+*/
+inline uint64_t strip_height(const IFD& ifd){
+    if((ifd.rows_per_strip<=0) || (ifd.rows_per_strip>ifd.height)){
+        return static_cast<uint64_t>(ifd.height);
+    }
+    return static_cast<uint64_t>(ifd.rows_per_strip);
+}
+
+
+/*
+ *  Function: is_tiled
+ *  ------------------
+ *  True if the image data of an IFD is stored in tiles (TileWidth and
+ *  TileLength are set) rather than strips. Tiles are numbered left to
+ *  right, then top to bottom.
+*/
+inline bool is_tiled(const IFD& ifd){
+    return (ifd.tile_width>0) && (ifd.tile_length>0);
+}
+
+
+/* Number of tiles in each row of tiles of a tiled image */
+inline uint64_t tiles_across(const IFD& ifd){
+    const uint64_t tile_width = static_cast<uint64_t>(ifd.tile_width);
+    return (static_cast<uint64_t>(ifd.width) + tile_width - 1) / tile_width;
+}
+
+
+/*
+ *  Function: chunk_size
+ *  --------------------
+ *  Size in bytes of one full, uncompressed strip or tile of an IFD.
+ *  Strips at the bottom and tiles at the right or bottom edges of the
+ *  image may be padded out to this size.
+*/
+inline uint64_t chunk_size(const IFD& ifd){
+    const uint64_t pixel_size = static_cast<uint64_t>(
+        ifd.samples_per_pixel * (ifd.bits_per_sample / 8)
+    );
+    if(is_tiled(ifd)){
+        return static_cast<uint64_t>(ifd.tile_width)
+            * static_cast<uint64_t>(ifd.tile_length)
+            * pixel_size;
+    }
+    return strip_height(ifd) * static_cast<uint64_t>(ifd.width) * pixel_size;
+}
+
+
+/*
+ *  Function: has_predictor
+ *  -----------------------
+ *  True if the strips or tiles of an IFD must be passed through a
+ *  predictor after decompression. As in libtiff, the Predictor tag is
+ *  ignored for uncompressed and PackBits images.
+*/
+inline bool has_predictor(const IFD& ifd){
+    return (ifd.compression!=COMPRESSION_NONE)
+        && (ifd.compression!=COMPRESSION_PACKBITS)
+        && (ifd.predictor>PREDICTOR_NONE);
+}
+
+
+/*
+ *  Function: is_supported_compression
+ *  ----------------------------------
+ *  True if strips compressed with *compression* can be decoded by this
+ *  build. Zstandard needs PITIFFUL_HAVE_ZSTD.
+*/
+inline bool is_supported_compression(int compression){
+    switch(compression){
+        case COMPRESSION_NONE:
+        case COMPRESSION_LZW:
+        case COMPRESSION_DEFLATE:
+        case COMPRESSION_PACKBITS:
+            return true;
+#if defined(PITIFFUL_HAVE_ZSTD)
+        case COMPRESSION_ZSTD:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+
+/*
+ *  Function: sample_type_code
+ *  --------------------------
+ *  Small integer that tells apart the sample types frames can be
+ *  decoded to, for use in cache keys.
+*/
+template <typename T>
+inline uint64_t sample_type_code(){
+    return (static_cast<uint64_t>(sizeof(T)) << 2)
+        | (std::is_floating_point<T>::value ? 2 : 0)
+        | (std::is_signed<T>::value ? 1 : 0);
+}
+
+
+/* Identifies a pitifful IFD index file; bump the version if the layout changes */
+static const char IFD_INDEX_MAGIC[8] = {'P', 'I', 'T', 'I', 'D', 'X', '\0', '\0'};
+static const uint32_t IFD_INDEX_VERSION = 4;
+
+
+/*
+ *  struct: FileStamp
+ *  -----------------
+ *  Size and modification time of a file. An IFD index is only trusted
+ *  if the stamp it records still matches the TIFF file.
+*/
+struct FileStamp {
+    uint64_t size = 0;
+    int64_t mtime_sec = 0;
+    int64_t mtime_nsec = 0;
+
+    bool operator==(const FileStamp& other) const{
+        return (size==other.size)
+            && (mtime_sec==other.mtime_sec)
+            && (mtime_nsec==other.mtime_nsec);
+    }
+};
+
+
+/*
+ *  Function: get_file_stamp
+ *  ------------------------
+ *  Return the size and modification time of the file at *path*.
+*/
+inline FileStamp get_file_stamp(const char* path){
+    struct stat st;
+    if(::stat(path, &st)!=0){
+        throw std::runtime_error(
+            std::string("failed to stat ") + std::string(path)
+        );
+    }
+    FileStamp stamp;
+    stamp.size = static_cast<uint64_t>(st.st_size);
+    stamp.mtime_sec = static_cast<int64_t>(st.st_mtime);
+#if defined(__APPLE__)
+    stamp.mtime_nsec = static_cast<int64_t>(st.st_mtimespec.tv_nsec);
+#elif defined(__linux__)
+    stamp.mtime_nsec = static_cast<int64_t>(st.st_mtim.tv_nsec);
+#endif
+    return stamp;
+}
+
+
+/*
+ *  Function: write_ifd_index
+ *  -------------------------
+ *  Write the IFDs of a TIFF file to a compact binary index, so that a
+ *  later TIFFReader can load them with one sequential read instead of
+ *  walking the IFD chain. The index is written in host byte order to a
+ *  temporary file that is then renamed into place, so concurrent
+ *  readers never see a partial index. Each writer has its own
+ *  temporary file, so processes or threads that open the same TIFF
+ *  for the first time at once do not write over each other.
+ *
+ *  Parameters
+ *  ----------
+ *    path      :   where to write the index
+ *    stamp     :   size and modification time of the TIFF file
+ *    ifds      :   every IFD in the file, in chain order
+ *    n_ifds    :   number of IFDs
+ *
+ *  Returns
+ *  -------
+ *    true if the index was written, false otherwise
+*/
+inline bool write_ifd_index(
+    const std::string& path,
+    const FileStamp& stamp,
+    const IFD* const* ifds,
+    uint64_t n_ifds
+){
+    std::vector<char> buf;
+    auto put = [&](const void* ptr, size_t size){
+        const char* c = static_cast<const char*>(ptr);
+        buf.insert(buf.end(), c, c+size);
+    };
+    auto put_u64 = [&](uint64_t x){put(&x, sizeof(x));};
+    auto put_i64 = [&](int64_t x){put(&x, sizeof(x));};
+    auto put_i32 = [&](int32_t x){put(&x, sizeof(x));};
+
+    const uint32_t byte_order_mark = 0x01020304;
+    put(IFD_INDEX_MAGIC, sizeof(IFD_INDEX_MAGIC));
+    put(&IFD_INDEX_VERSION, sizeof(IFD_INDEX_VERSION));
+    put(&byte_order_mark, sizeof(byte_order_mark));
+    put_u64(stamp.size);
+    put_i64(stamp.mtime_sec);
+    put_i64(stamp.mtime_nsec);
+    put_u64(n_ifds);
+    for(uint64_t i=0; i<n_ifds; ++i){
+        const IFD& ifd = *ifds[i];
+        put_u64(ifd.byte_offset);
+        put_u64(ifd.next_byte_offset);
+        put_u64(ifd.count);
+        put_i32(ifd.width);
+        put_i32(ifd.height);
+        put_i32(ifd.bits_per_sample);
+        put_i32(ifd.compression);
+        put_i32(ifd.photometric_interpretation);
+        put_i32(ifd.samples_per_pixel);
+        put_i32(ifd.rows_per_strip);
+        put_i32(ifd.tile_width);
+        put_i32(ifd.tile_length);
+        put_i32(ifd.sample_format);
+        put_i32(ifd.predictor);
+        put_u64(ifd.strip_offsets.size());
+        put(ifd.strip_offsets.data(), ifd.strip_offsets.size()*sizeof(uint64_t));
+        put_u64(ifd.strip_byte_counts.size());
+        put(ifd.strip_byte_counts.data(), ifd.strip_byte_counts.size()*sizeof(uint64_t));
+    }
+
+    // Unique per process (pid) and per call within it (counter)
+    static std::atomic<uint64_t> n_written(0);
+    const std::string tmp_path = path + std::string(".") + std::to_string(getpid())
+        + std::string(".") + std::to_string(n_written++) + std::string(".tmp");
+    {
+        std::ofstream f(tmp_path, std::ios::out | std::ios::binary | std::ios::trunc);
+        if(!f.is_open()){
+            return false;
+        }
+        f.write(buf.data(), buf.size());
+        f.close();
+        if(!f){
+            std::remove(tmp_path.c_str());
+            return false;
+        }
+    }
+    if(std::rename(tmp_path.c_str(), path.c_str())!=0){
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ *  Function: read_ifd_index
+ *  ------------------------
+ *  Load an index written by write_ifd_index.
+ *
+ *  Parameters
+ *  ----------
+ *    path      :   location of the index
+ *    stamp     :   current size and modification time of the TIFF file
+ *    ifds      :   output; the IFDs recorded in the index
+ *
+ *  Returns
+ *  -------
+ *    true if the index exists, is well-formed, and matches *stamp*;
+ *    false otherwise (in which case *ifds* should be ignored)
+*/
+inline bool read_ifd_index(
+    const std::string& path,
+    const FileStamp& stamp,
+    std::vector<IFD>& ifds
+){
+    std::ifstream f(path, std::ios::in | std::ios::binary);
+    if(!f.is_open()){
+        return false;
+    }
+    std::vector<char> buf(
+        (std::istreambuf_iterator<char>(f)),
+        std::istreambuf_iterator<char>()
+    );
+    size_t pos = 0;
+    auto get = [&](void* ptr, size_t size){
+        if(size>buf.size()-pos){
+            return false;
+        }
+        std::memcpy(ptr, buf.data()+pos, size);
+        pos += size;
+        return true;
+    };
+    auto get_u64 = [&](uint64_t& x){return get(&x, sizeof(x));};
+    auto get_i64 = [&](int64_t& x){return get(&x, sizeof(x));};
+    auto get_i32 = [&](int& x){
+        int32_t y;
+        if(!get(&y, sizeof(y))){
+            return false;
+        }
+        x = static_cast<int>(y);
+        return true;
+    };
+    auto get_array = [&](std::vector<uint64_t>& v){
+        uint64_t n;
+        if((!get_u64(n)) || (n>(buf.size()-pos)/sizeof(uint64_t))){
+            return false;
+        }
+        v.resize(n);
+        return get(v.data(), n*sizeof(uint64_t));
+    };
+
+    char magic[sizeof(IFD_INDEX_MAGIC)];
+    uint32_t version, byte_order_mark;
+    FileStamp recorded;
+    uint64_t n_ifds;
+    if(
+        (!get(magic, sizeof(magic)))
+        || (std::memcmp(magic, IFD_INDEX_MAGIC, sizeof(magic))!=0)
+        || (!get(&version, sizeof(version)))
+        || (version!=IFD_INDEX_VERSION)
+        || (!get(&byte_order_mark, sizeof(byte_order_mark)))
+        || (byte_order_mark!=0x01020304)
+        || (!get_u64(recorded.size))
+        || (!get_i64(recorded.mtime_sec))
+        || (!get_i64(recorded.mtime_nsec))
+        || (!(recorded==stamp))
+        || (!get_u64(n_ifds))
+    ){
+        return false;
+    }
+
+    ifds.clear();
+    for(uint64_t i=0; i<n_ifds; ++i){
+        IFD ifd;
+        if(
+            (!get_u64(ifd.byte_offset))
+            || (!get_u64(ifd.next_byte_offset))
+            || (!get_u64(ifd.count))
+            || (!get_i32(ifd.width))
+            || (!get_i32(ifd.height))
+            || (!get_i32(ifd.bits_per_sample))
+            || (!get_i32(ifd.compression))
+            || (!get_i32(ifd.photometric_interpretation))
+            || (!get_i32(ifd.samples_per_pixel))
+            || (!get_i32(ifd.rows_per_strip))
+            || (!get_i32(ifd.tile_width))
+            || (!get_i32(ifd.tile_length))
+            || (!get_i32(ifd.sample_format))
+            || (!get_i32(ifd.predictor))
+            || (!get_array(ifd.strip_offsets))
+            || (!get_array(ifd.strip_byte_counts))
+        ){
+            return false;
+        }
+        ifds.push_back(std::move(ifd));
+    }
+    return pos==buf.size();
+}
+
+
+/*
+ *  struct: StripRun
+ *  ---------------
+ *  Uncompressed strips, possibly from several frames, that are stored
+ *  back to back in the file and also land back to back in the output,
+ *  so that they can be read with a single request.
+*/
+struct StripRun {
+    // IFD of the first strip. All strips in a run share its sample type.
+    const IFD* ifd;
+
+    // Location of the run in the file, in bytes
+    uint64_t offset, size;
+
+    // Index of the output sample the run starts at
+    uint64_t out_start;
+};
+
+
+/*
+ *  struct: DecodeContext
+ *  ---------------------
+ *  Scratch state needed to decode one strip: a buffer for the raw
+ *  (compressed) bytes, a buffer for the decompressed strip, and the
+ *  decompressor state. Each thread decoding strips uses its own context.
+*/
+struct DecodeContext {
+    // Raw strip bytes as stored in the file. Unused when the file is
+    // memory-mapped, since we then decompress straight from the mapping.
+    std::vector<char> compressed_buffer;
+
+    // Decompressed strip
+    std::vector<char> strip_buffer;
+
+    // One row of a strip, used to undo the floating-point predictor
+    std::vector<char> predictor_buffer;
+
+    std::unique_ptr<DEFLATEDecompressor> deflate_decompressor;
+    std::unique_ptr<LZWDecompressor> lzw_decompressor;
+#if defined(PITIFFUL_HAVE_ZSTD)
+    std::unique_ptr<ZSTDDecompressor> zstd_decompressor;
+#endif
+
+    // Raw bytes of one strip or tile that have already been read (by
+    // read_frame_batch), starting at byte *staged_offset* of the file.
+    // load_chunk takes them from here instead of reading them again.
+    const char* staged = nullptr;
+    uint64_t staged_offset = 0;
+    uint64_t staged_size = 0;
+
+    /* Return a buffer of at least *size* bytes for raw strip data */
+    char* get_compressed_buffer(uint64_t size){
+        if(compressed_buffer.size()<size){
+            compressed_buffer.resize(size);
+        }
+        return compressed_buffer.data();
+    }
+
+    /* Return a buffer of at least *size* bytes for a decompressed strip */
+    char* get_strip_buffer(uint64_t size){
+        if(strip_buffer.size()<size){
+            strip_buffer.resize(size);
+        }
+        return strip_buffer.data();
+    }
+
+    /* Return a buffer of at least *size* bytes for one predicted row */
+    char* get_predictor_buffer(uint64_t size){
+        if(predictor_buffer.size()<size){
+            predictor_buffer.resize(size);
+        }
+        return predictor_buffer.data();
+    }
+
+    DEFLATEDecompressor& get_deflate_decompressor(){
+        if(!deflate_decompressor){
+            deflate_decompressor.reset(new DEFLATEDecompressor());
+        }
+        return *deflate_decompressor;
+    }
+
+    LZWDecompressor& get_lzw_decompressor(){
+        if(!lzw_decompressor){
+            lzw_decompressor.reset(new LZWDecompressor());
+        }
+        return *lzw_decompressor;
+    }
+
+#if defined(PITIFFUL_HAVE_ZSTD)
+    ZSTDDecompressor& get_zstd_decompressor(){
+        if(!zstd_decompressor){
+            zstd_decompressor.reset(new ZSTDDecompressor());
+        }
+        return *zstd_decompressor;
+    }
+#endif
+};
+
+
+/*
+ *  struct: ReaderOptions
+ *  ---------------------
+ *  Construction-time settings for a TIFFReader. The defaults reproduce
+ *  the original behavior (buffered std::ifstream reads).
+*/
+struct ReaderOptions {
+    // How the file is accessed: IO_STREAM (seek + read into a buffer),
+    // IO_MMAP (read directly from a memory mapping of the file),
+    // IO_PREAD (positional reads that never block other threads), or
+    // IO_URING (IO_PREAD, plus io_uring for read_frame_batch on Linux)
+    int io_mode = IO_STREAM;
+
+    // Number of threads used to decode the strips of a single frame.
+    // 1 decodes serially; 0 uses one thread per hardware core.
+    int n_threads = 1;
+
+    // If true, IFDs are parsed the first time they are needed rather
+    // than all at once in the constructor. Useful for opening files with
+    // very many pages when only a few of them will be read.
+    bool lazy = false;
+
+    // If true, load the IFDs from a sidecar index file when one exists
+    // and matches the TIFF's size and modification time. Otherwise parse
+    // the whole IFD chain and write the index for next time.
+    bool use_index = false;
+
+    // Location of the sidecar index; defaults to the TIFF path followed
+    // by ".pitindex"
+    std::string index_path;
+
+    // Memory budget (in bytes) for keeping decompressed tiles of tiled
+    // images, so that reading overlapping regions does not decompress
+    // the same tiles again. 0 disables the cache.
+    uint64_t tile_cache_bytes = 0;
+
+    // Memory budget (in bytes) for keeping whole decoded frames, so that
+    // reading a frame again with read_frame costs a copy rather than a
+    // decode. Frames read as different output types are kept separately.
+    // 0 disables the cache.
+    uint64_t frame_cache_bytes = 0;
+
+    // Largest single read (in bytes) used for a run of uncompressed
+    // strips that are stored back to back, within a frame or across the
+    // frames of read_frames. 0 reads every strip separately.
+    uint64_t coalesce_bytes = 1 << 22;
+
+    // With IO_URING, the number of reads read_frame_batch keeps in flight
+    unsigned io_queue_depth = 64;
+
+    // If true, count the bytes and time spent reading, decompressing, and
+    // converting (see TIFFReader::get_stats). Can also be switched on
+    // later with set_collect_stats.
+    bool collect_stats = false;
+};
+
+
 /*
  *  Class: TIFFReader
  *  -----------------
  *  Basic TIFF reading class.
+ *
+ *  Once constructed, a TIFFReader can be shared between threads:
+ *  read_frame may be called concurrently, and each call decodes with
+ *  its own scratch buffers and inflate state. With IO_STREAM the reads
+ *  themselves are serialized on the single stream; use IO_PREAD or
+ *  IO_MMAP to let them proceed in parallel too.
 */
 class TIFFReader {
 private:
-    // filestream
-    std::ifstream s;
+    // raw file access; shared with views into the file (see view_frame)
+    std::shared_ptr<FileSource> src;
 
     // endian-ness of host, file
     bool host_is_big_endian, file_is_big_endian;
 
-    // buffer for parsing IFDs
-    char ifd_parse_buffer[10000];
+    // True for BigTIFF (64-bit offsets), false for classic TIFF
+    bool big_tiff;
 
-    // Image file directories
-    std::vector<IFD> ifds;
+    // If true, parse IFDs on first access (see ReaderOptions::lazy)
+    bool lazy;
 
-    // Total number of frames in this TIFF file
-    uint64_t n_frames;
+    // Byte offsets of the IFDs discovered so far, in chain order
+    mutable std::vector<uint64_t> ifd_offsets;
 
-    // Size of the largest strip in the file (in bytes)
-    uint64_t max_strip_size;
+    // Image file directories, indexed like *ifd_offsets*. An entry is
+    // nullptr until that IFD has been parsed. The IFDs themselves never
+    // move, so references handed out by get_ifd stay valid.
+    mutable std::vector<std::unique_ptr<IFD>> ifds;
 
-    // Size of the strip_buffer (below). This is the maximum
-    // number of bytes required to hold a single uncompressed
-    // strip in memory.
-    uint64_t strip_buffer_size;
+    // Byte offset of the first IFD not yet in *ifd_offsets*, or 0 once
+    // the end of the IFD chain has been reached
+    mutable uint64_t next_ifd_offset;
 
-    // Buffers for image file reading
-    std::unique_ptr<char[]> ustrip_buffer;
-    char* strip_buffer;
+    // Size of the largest strip among the parsed IFDs (in bytes)
+    mutable uint64_t max_strip_size;
 
-    DEFLATEDecompressor* deflate_decompressor;
+    // Guards the lazily-populated IFD state above
+    mutable std::mutex ifds_mutex;
 
-public:
-    TIFFReader(const char* path):
-        host_is_big_endian(false),
-        file_is_big_endian(false),
-        n_frames(0),
-        max_strip_size(0),
-        strip_buffer_size(0),
-        ustrip_buffer(nullptr),
-        strip_buffer(nullptr),
-        deflate_decompressor(nullptr)
-    {
-        s.open(path, std::ios::in | std::ios::binary);
-        if(!s.is_open()){
-            throw std::runtime_error(
-                std::string("failed to open ") + std::string(path)
-            );
-        }
-        host_is_big_endian = !determine_if_host_is_little_endian();
+    // Idle decoding contexts, reused across strips and frames so that
+    // buffers and inflate state are only allocated once per thread
+    std::vector<std::unique_ptr<DecodeContext>> contexts;
+    std::mutex contexts_mutex;
 
-        // File reading buffer
-        char* c = &ifd_parse_buffer[0];
+    // Workers for decoding the strips of a frame in parallel, or
+    // nullptr when decoding serially
+    std::unique_ptr<ThreadPool> pool;
 
-        // TIFF header
-        s.read(c, 8);
+    // Decompressed tiles, keyed by (frame, tile)
+    typedef LRUCache<std::pair<uint64_t, uint64_t>> TileCache;
+    TileCache tile_cache;
 
-        // First 2 bytes encode endianness of file
-        if((c[0]=='\x49') && (c[1]=='\x49')){
-            file_is_big_endian=false;
-        } 
+    // Decoded frames, keyed by (frame, sample_type_code<T>())
+    typedef LRUCache<std::pair<uint64_t, uint64_t>> FrameCache;
+    FrameCache frame_cache;
 
-        // Current do not support mismatches between endian-ness of
-        // file and host
-        if(host_is_big_endian!=file_is_big_endian){
-            throw std::runtime_error(
-                "currently do not support host/file endian-ness mismatches"
-            );
-        }
+    // Largest coalesced read (see ReaderOptions::coalesce_bytes)
+    uint64_t coalesce_bytes;
 
-        // Next 2 bytes always encode the number 42
-        if(file_is_big_endian){
-            if((c[2]!='\x00') || (c[3]!='\x2A')){
-                throw std::runtime_error("TIFF magic missing; not a TIFF file");
-            }
-        } else{
-            if((c[2]!='\x2A') || (c[3]!='\x00')){
-                throw std::runtime_error("TIFF magic missing; not a TIFF file");
+    // Per-stage counters (see ReaderOptions::collect_stats)
+    mutable StatsCounters stats;
+
+    /*
+     *  Class: ContextLease
+     *  -------------------
+     *  Borrows a DecodeContext from the reader for the lifetime of
+     *  the lease, creating one if none are idle.
+    */
+    class ContextLease {
+        TIFFReader& reader;
+        std::unique_ptr<DecodeContext> ctx;
+    public:
+        ContextLease(TIFFReader& reader): reader(reader) {
+            std::lock_guard<std::mutex> lock(reader.contexts_mutex);
+            if(reader.contexts.empty()){
+                ctx.reset(new DecodeContext());
+            } else{
+                ctx = std::move(reader.contexts.back());
+                reader.contexts.pop_back();
             }
         }
-
-        // Bytes 4, 5, 6, and 7 encode the byte offset of the first IFD from BOF
-        uint64_t ifd_offset = static_cast<uint64_t>(*reinterpret_cast<uint32_t*>(c+4));
-        while(ifd_offset>0){
-            IFD ifd = parse_ifd(ifd_offset);
-            ifd_offset = ifd.next_byte_offset;
-            ifds.push_back(ifd);
+        ~ContextLease(){
+            std::lock_guard<std::mutex> lock(reader.contexts_mutex);
+            reader.contexts.push_back(std::move(ctx));
         }
+        DecodeContext& operator*(){return *ctx;}
+    };
 
-        // Total number of IFDs
-        n_frames = static_cast<uint64_t>(ifds.size());
+    /*
+     *  Method: skim_ifd
+     *  ----------------
+     *  Return the byte offset of the IFD following the one at
+     *  *byte_offset*, reading only its field count and next-IFD pointer.
+    */
+    uint64_t skim_ifd(uint64_t byte_offset) const{
+        char count_bytes[8];
+        const uint64_t count = parse_ifd_count(
+            fetch(byte_offset, ifd_count_size(), count_bytes)
+        );
+        char next_bytes[8];
+        return parse_uint_field<uint64_t>(
+            offset_type(),
+            fetch(
+                byte_offset + ifd_count_size() + ifd_field_size()*count,
+                offset_size(),
+                next_bytes
+            ),
+            swap_bytes()
+        );
+    }
 
-        // Size of the largest strip in the entire file (in bytes)
-        uint64_t strip_size;
-        for(uint64_t frame=0; frame<n_frames; ++frame){
-            const IFD& ifd = ifds[frame];
-            if(ifd.compression==COMPRESSION_DEFLATE){
-                strip_size = static_cast<uint64_t>(
-                    ifd.rows_per_strip*ifd.width*ifd.samples_per_pixel*(ifd.bits_per_sample/8)
-                );
-            }
-            else{
-                strip_size = *std::max_element(
-                    ifd.strip_byte_counts.begin(),
-                    ifd.strip_byte_counts.end()
-                );
-            }
-            if(strip_size>max_strip_size){
-                max_strip_size = strip_size;
+    /*
+     *  Method: discover_ifds
+     *  ---------------------
+     *  Follow the IFD chain until at least *n* IFDs are known or the
+     *  chain ends. In lazy mode only the IFD offsets are recorded;
+     *  otherwise each IFD is fully parsed along the way. The caller must
+     *  hold *ifds_mutex* (or be the constructor).
+    */
+    void discover_ifds(uint64_t n) const{
+        while((next_ifd_offset>0) && (ifd_offsets.size()<n)){
+            const uint64_t offset = next_ifd_offset;
+            ifd_offsets.push_back(offset);
+            if(lazy){
+                ifds.emplace_back(nullptr);
+                next_ifd_offset = skim_ifd(offset);
+            } else{
+                ifds.emplace_back(new IFD(parse_ifd(offset)));
+                update_max_strip_size(*ifds.back());
+                next_ifd_offset = ifds.back()->next_byte_offset;
             }
         }
-
-        // Allocate a buffer for reading strips
-        ustrip_buffer = std::make_unique<char[]>(max_strip_size);
-        strip_buffer = &ustrip_buffer[0];
     }
 
-    /* Getters */
-    const IFD& get_ifd(uint64_t frame) const{
-        if(frame>=n_frames){
+    /*
+     *  Method: ifd_at
+     *  --------------
+     *  Return the IFD for *frame*, discovering and parsing it first if
+     *  necessary. The caller must hold *ifds_mutex*.
+    */
+    const IFD& ifd_at(uint64_t frame) const{
+        discover_ifds(frame+1);
+        if(frame>=ifd_offsets.size()){
             throw std::runtime_error(
                 std::string("frame ") + std::to_string(frame)
                 + std::string(" out of bounds")
             );
         }
-        return ifds[frame];
+        if(!ifds[frame]){
+            ifds[frame].reset(new IFD(parse_ifd(ifd_offsets[frame])));
+            update_max_strip_size(*ifds[frame]);
+        }
+        return *ifds[frame];
     }
-    uint64_t get_n_frames() const{return n_frames;}
-    uint64_t get_max_strip_size() const{return max_strip_size;}
-
 
     /*
-     *  Method: get_n_samples
-     *  ---------------------
-     *  Return the total number of samples in a single frame.
+     *  Method: load_index
+     *  ------------------
+     *  Replace the IFD chain with the contents of a sidecar index, if it
+     *  is valid for this file. Returns true on success.
     */
-    int get_n_samples(int frame) const{
-        const IFD& ifd = ifds[frame];
-        return ifd.height * ifd.width * ifd.samples_per_pixel;
+    bool load_index(const std::string& index_path, const FileStamp& stamp){
+        std::vector<IFD> loaded;
+        if(!read_ifd_index(index_path, stamp, loaded)){
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(ifds_mutex);
+        ifd_offsets.clear();
+        ifds.clear();
+        max_strip_size = 0;
+        for(IFD& ifd : loaded){
+            ifd_offsets.push_back(ifd.byte_offset);
+            ifds.emplace_back(new IFD(std::move(ifd)));
+            update_max_strip_size(*ifds.back());
+        }
+        next_ifd_offset = 0;
+        return true;
     }
 
+    /* True if multi-byte values in the file must be byte-swapped */
+    bool swap_bytes() const{return host_is_big_endian!=file_is_big_endian;}
 
     /*
-     *  Method: read_frame
-     *  ------------------
-     *  Read a single frame into memory.
-     *
-     *  Parameters
-     *  ----------
-     *    T     :   type of the destination array
-     *    frame :   index of the target frame (from 0 to n_frames-1)
-     *    out   :   allocated array of size *get_n_samples(frame)*
+     *  True if decoded samples of *ifd* are still in the file's byte order
+     *  and it differs from the host's. Undoing a predictor already puts
+     *  the samples in host order.
     */
-    template <typename T>
-    void read_frame(int frame, T* out){
-        const IFD& ifd = ifds[frame];
+    bool swaps_samples(const IFD& ifd) const{
+        return swap_bytes() && (!has_predictor(ifd));
+    }
 
-        // Total number of strips to read
-        int n_strips = ifd.strip_offsets.size();
+    /*
+     *  IFD layout, which differs between classic TIFF and BigTIFF: the
+     *  size of the field count at the start of an IFD, of each field,
+     *  and of offsets (the value slot of each field and the next-IFD
+     *  pointer), plus the field type used to read offsets.
+    */
+    uint64_t ifd_count_size() const{return big_tiff ? 8 : 2;}
+    uint64_t ifd_field_size() const{return big_tiff ? 20 : 12;}
+    uint64_t offset_size() const{return big_tiff ? 8 : 4;}
+    uint16_t offset_type() const{return big_tiff ? 16 : 4;}
+
+    /* Parse the field count at the start of an IFD */
+    uint64_t parse_ifd_count(const char* c) const{
+        return parse_uint_field<uint64_t>(big_tiff ? 16 : 3, c, swap_bytes());
+    }
 
-        for(int strip=0; strip<n_strips; ++strip){
-            // Go to this position in the file
-            s.seekg(ifd.strip_offsets[strip], s.beg);
+    /* Fold the strip sizes of a newly parsed IFD into *max_strip_size* */
+    void update_max_strip_size(const IFD& ifd) const{
+        uint64_t strip_size = 0;
+        if(ifd.compression!=COMPRESSION_NONE){
+            strip_size = chunk_size(ifd);
+        }
+        else if(!ifd.strip_byte_counts.empty()){
+            strip_size = *std::max_element(
+                ifd.strip_byte_counts.begin(),
+                ifd.strip_byte_counts.end()
+            );
+        }
+        if(strip_size>max_strip_size){
+            max_strip_size = strip_size;
+        }
+    }
 
-            // Read the raw bytes, decompressing if necessary
-            unsigned uncompressed_strip_size = 0;
-            if(ifd.compression==COMPRESSION_NONE){
-                s.read(strip_buffer, ifd.strip_byte_counts[strip]);
-                uncompressed_strip_size = ifd.strip_byte_counts[strip] * 8 / ifd.bits_per_sample;
-            }
-            else if(ifd.compression==COMPRESSION_DEFLATE){
-                if(!deflate_decompressor){
-                    deflate_decompressor = new DEFLATEDecompressor(
-                        static_cast<unsigned>(max_strip_size)
-                    );
-                }
-                deflate_decompressor->decompress(
-                    s,
-                    strip_buffer,
-                    ifd.strip_byte_counts[strip],
-                    uncompressed_strip_size,
-                    static_cast<unsigned>(max_strip_size)
-                );
-            }
-            else{
-                throw std::runtime_error(
-                    std::string("unsupported compression type ")
-                    + std::to_string(ifd.compression)
-                );
-            }
+    /*
+     *  Method: fetch
+     *  -------------
+     *  Return a pointer to *size* bytes of the file starting at *offset*.
+     *  If the file is memory-mapped this points into the mapping;
+     *  otherwise the bytes are read into *buffer*, which must be at
+     *  least *size* bytes.
+    */
+    const char* fetch(uint64_t offset, uint64_t size, char* buffer) const{
+        const char* ptr = src->view(offset, size);
+        if(ptr){
+            stats.add_mapped(size);
+            return ptr;
+        }
+        read_source(offset, size, buffer);
+        return buffer;
+    }
 
-            // Decode
-            if(ifd.bits_per_sample==8){
-                _parse_array<uint8_t, T>(
-                    uncompressed_strip_size,
-                    host_is_big_endian,
-                    file_is_big_endian,
-                    strip_buffer,
-                    out
-                );
-            } else if(ifd.bits_per_sample==16){
-                _parse_array<uint16_t, T>(
-                    uncompressed_strip_size,
-                    host_is_big_endian,
-                    file_is_big_endian,
-                    strip_buffer,
-                    out
-                );
-            } else if(ifd.bits_per_sample==32){
-                 _parse_array<uint32_t, T>(
-                    uncompressed_strip_size,
-                    host_is_big_endian,
-                    file_is_big_endian,
-                    strip_buffer,
-                    out
+    /* src->read, counted in the reader's stats */
+    void read_source(uint64_t offset, uint64_t size, char* buffer) const{
+        const uint64_t start = stats.start();
+        src->read(offset, size, buffer);
+        stats.add_read(start, size);
+    }
+
+    /*
+     *  Method: read_source_batch
+     *  -------------------------
+     *  src->read_batch, counted in the reader's stats. Time spent in
+     *  *on_read* is left out of the read time.
+    */
+    void read_source_batch(
+        const ReadRequest* requests,
+        size_t n,
+        const std::function<void(size_t)>& on_read
+    ) const{
+        uint64_t start = stats.start();
+        if(!start){
+            src->read_batch(requests, n, on_read);
+            return;
+        }
+        src->read_batch(requests, n, [&](size_t i){
+            const uint64_t callback_start = stats.start();
+            on_read(i);
+            const uint64_t callback_end = stats.start();
+            if((callback_start) && (callback_end)){
+                start += callback_end - callback_start;
+            }
+        });
+        uint64_t bytes = 0;
+        for(size_t i=0; i<n; ++i){
+            bytes += requests[i].size;
+        }
+        stats.add_read(start, bytes, n);
+    }
+
+    /*
+     *  Method: fetch_chunk
+     *  -------------------
+     *  fetch() for the raw bytes of a strip or tile, except that bytes
+     *  already staged in *ctx* by read_frame_batch are returned as they
+     *  are, without touching the file.
+    */
+    const char* fetch_chunk(
+        const DecodeContext& ctx,
+        uint64_t offset,
+        uint64_t size,
+        char* buffer
+    ) const{
+        if((ctx.staged) && (ctx.staged_offset==offset) && (size<=ctx.staged_size)){
+            return ctx.staged;
+        }
+        return fetch(offset, size, buffer);
+    }
+
+public:
+    TIFFReader(const char* path, const ReaderOptions& options = ReaderOptions()):
+        host_is_big_endian(false),
+        file_is_big_endian(false),
+        big_tiff(false),
+        lazy(options.lazy),
+        next_ifd_offset(0),
+        max_strip_size(0),
+        tile_cache(options.tile_cache_bytes),
+        frame_cache(options.frame_cache_bytes),
+        coalesce_bytes(options.coalesce_bytes),
+        stats(options.collect_stats)
+    {
+        if(options.io_mode==IO_STREAM){
+            src.reset(new StreamSource(path));
+        } else if(options.io_mode==IO_MMAP){
+            src.reset(new MmapSource(path));
+        } else if(options.io_mode==IO_PREAD){
+            src.reset(new PReadSource(path));
+        } else if(options.io_mode==IO_URING){
+            src.reset(new URingSource(path, options.io_queue_depth));
+        } else{
+            throw std::runtime_error(
+                std::string("unrecognized io_mode ") + std::to_string(options.io_mode)
+            );
+        }
+        host_is_big_endian = !determine_if_host_is_little_endian();
+
+        // TIFF header
+        char header[8];
+        const char* c = fetch(0, 8, header);
+
+        // First 2 bytes encode endianness of file: "II" (little-endian)
+        // or "MM" (big-endian). Values are byte-swapped as they are parsed
+        // whenever this differs from the host.
+        if((c[0]=='\x49') && (c[1]=='\x49')){
+            file_is_big_endian=false;
+        } else if((c[0]=='\x4D') && (c[1]=='\x4D')){
+            file_is_big_endian=true;
+        } else{
+            throw std::runtime_error("unrecognized TIFF byte order mark; not a TIFF file");
+        }
+
+        // Next 2 bytes encode the number 42, or 43 for BigTIFF
+        const uint16_t version = parse_uint_field<uint16_t>(3, c+2, swap_bytes());
+        if(version==TIFF_VERSION_CLASSIC){
+            // Bytes 4, 5, 6, and 7 encode the byte offset of the first IFD from BOF
+            next_ifd_offset = parse_uint_field<uint64_t>(4, c+4, swap_bytes());
+        } else if(version==TIFF_VERSION_BIG){
+            // Bytes 4-5 give the size of offsets (always 8) and bytes 6-7
+            // are zero. Bytes 8-15 encode the byte offset of the first IFD.
+            big_tiff = true;
+            char big_header[16];
+            c = fetch(0, 16, big_header);
+            if(parse_uint_field<uint16_t>(3, c+4, swap_bytes())!=8){
+                throw std::runtime_error("unsupported BigTIFF offset size");
+            }
+            next_ifd_offset = parse_uint_field<uint64_t>(16, c+8, swap_bytes());
+        } else{
+            throw std::runtime_error("TIFF magic missing; not a TIFF file");
+        }
+
+        if(options.use_index){
+            const std::string index_path = options.index_path.empty()
+                ? std::string(path) + std::string(".pitindex")
+                : options.index_path;
+            const FileStamp stamp = get_file_stamp(path);
+            if(!load_index(index_path, stamp)){
+                // Parse every IFD, even if lazy, so that the index is complete
+                const uint64_t n_frames = get_n_frames();
+                for(uint64_t frame=0; frame<n_frames; ++frame){
+                    get_ifd(frame);
+                }
+                save_index(index_path, stamp);
+            }
+        }
+
+        // Unless lazy, walk and parse the entire IFD chain now
+        if(!lazy){
+            discover_ifds(UINT64_MAX);
+        }
+
+        set_n_threads(options.n_threads);
+    }
+
+    /* Getters */
+    const IFD& get_ifd(uint64_t frame) const{
+        std::lock_guard<std::mutex> lock(ifds_mutex);
+        return ifd_at(frame);
+    }
+    uint64_t get_n_frames() const{
+        std::lock_guard<std::mutex> lock(ifds_mutex);
+        discover_ifds(UINT64_MAX);
+        return static_cast<uint64_t>(ifd_offsets.size());
+    }
+    uint64_t get_max_strip_size() const{
+        std::lock_guard<std::mutex> lock(ifds_mutex);
+        return max_strip_size;
+    }
+
+    /*
+     *  The file source. Holding on to it keeps pointers returned by
+     *  view_frame and view_frames valid after the reader is destroyed.
+    */
+    std::shared_ptr<FileSource> get_source() const{return src;}
+
+
+    /*
+     *  Method: save_index
+     *  ------------------
+     *  Parse every IFD in the file and write them to a sidecar index
+     *  (see ReaderOptions::use_index).
+     *
+     *  Parameters
+     *  ----------
+     *    index_path    :   where to write the index
+     *    stamp         :   size and modification time of the TIFF file
+     *
+     *  Returns
+     *  -------
+     *    true if the index was written, false otherwise
+    */
+    bool save_index(const std::string& index_path, const FileStamp& stamp) const{
+        const uint64_t n_frames = get_n_frames();
+        std::vector<const IFD*> all_ifds;
+        for(uint64_t frame=0; frame<n_frames; ++frame){
+            all_ifds.push_back(&get_ifd(frame));
+        }
+        return write_ifd_index(index_path, stamp, all_ifds.data(), n_frames);
+    }
+    int get_n_threads() const{return pool ? pool->size() : 1;}
+
+    /* Cache of decompressed tiles (see ReaderOptions::tile_cache_bytes) */
+    TileCache& get_tile_cache(){return tile_cache;}
+
+    /* Cache of decoded frames (see ReaderOptions::frame_cache_bytes) */
+    FrameCache& get_frame_cache(){return frame_cache;}
+
+    /* Largest coalesced read (see ReaderOptions::coalesce_bytes) */
+    uint64_t get_coalesce_bytes() const{return coalesce_bytes;}
+    void set_coalesce_bytes(uint64_t bytes){coalesce_bytes = bytes;}
+
+    /* Per-stage counters (see ReaderOptions::collect_stats and ReaderStats) */
+    ReaderStats get_stats() const{return stats.snapshot();}
+    void reset_stats(){stats.reset();}
+    bool get_collect_stats() const{return stats.is_enabled();}
+    void set_collect_stats(bool on){stats.set_enabled(on);}
+
+
+    /*
+     *  Method: set_n_threads
+     *  ---------------------
+     *  Set the number of threads used to decode the strips of each
+     *  frame in read_frame. 1 decodes serially; 0 (or any negative
+     *  value) uses one thread per hardware core.
+    */
+    void set_n_threads(int n_threads){
+        if(n_threads<=0){
+            n_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        }
+        if(n_threads==get_n_threads()){
+            return;
+        }
+        pool.reset(n_threads>1 ? new ThreadPool(n_threads) : nullptr);
+    }
+
+
+    /*
+     *  Method: get_n_samples
+     *  ---------------------
+     *  Return the total number of samples in a single frame.
+    */
+    int get_n_samples(int frame) const{
+        const IFD& ifd = get_ifd(frame);
+        return ifd.height * ifd.width * ifd.samples_per_pixel;
+    }
+
+
+    /*
+     *  Method: read_frame
+     *  ------------------
+     *  Read a single frame into memory.
+     *
+     *  Parameters
+     *  ----------
+     *    T     :   type of the destination array
+     *    frame :   index of the target frame (from 0 to n_frames-1)
+     *    out   :   allocated array of size *get_n_samples(frame)*
+    */
+    template <typename T>
+    void read_frame(int frame, T* out){
+        if(frame_cache.get_capacity()==0){
+            decode_frame<T>(frame, out);
+            return;
+        }
+        const FrameCache::Buffer buffer = read_frame_shared<T>(frame);
+        std::memcpy(out, buffer->data(), buffer->size());
+    }
+
+
+    /*
+     *  Method: read_frame_shared
+     *  -------------------------
+     *  Read a single frame into a buffer that may be shared with the
+     *  frame cache: a cached frame is returned without any copy, and a
+     *  newly decoded one is added to the cache. The buffer holds
+     *  get_n_samples(frame) samples of type *T* and must not be modified.
+     *
+     *  Parameters
+     *  ----------
+     *    T     :   sample type of the returned buffer
+     *    frame :   index of the target frame (from 0 to n_frames-1)
+    */
+    template <typename T>
+    FrameCache::Buffer read_frame_shared(int frame){
+        const uint64_t size = static_cast<uint64_t>(get_n_samples(frame)) * sizeof(T);
+        const bool caching = frame_cache.get_capacity()>0;
+        const std::pair<uint64_t, uint64_t> key(
+            static_cast<uint64_t>(frame),
+            sample_type_code<T>()
+        );
+        if(caching){
+            FrameCache::Buffer cached = frame_cache.get(key);
+            if(cached){
+                return cached;
+            }
+        }
+        std::shared_ptr<std::vector<char>> buffer(
+            new std::vector<char>(static_cast<size_t>(size))
+        );
+        decode_frame<T>(frame, reinterpret_cast<T*>(buffer->data()));
+        if(caching){
+            frame_cache.put(key, buffer);
+        }
+        return buffer;
+    }
+
+
+    /*
+     *  Method: decode_frame
+     *  --------------------
+     *  Read and decode a single frame into *out*, bypassing the frame
+     *  cache. Arguments are as for read_frame.
+    */
+    template <typename T>
+    void decode_frame(int frame, T* out){
+        const IFD& ifd = get_ifd(frame);
+
+        // Tiles are independent, and each lands in its own rectangle of *out*
+        if(is_tiled(ifd)){
+            const uint64_t width = static_cast<uint64_t>(ifd.width);
+            const uint64_t height = static_cast<uint64_t>(ifd.height);
+            for_each_chunk(ifd.strip_offsets.size(), [&](uint64_t tile, DecodeContext& ctx){
+                decode_tile<T>(ifd, frame, tile, ctx, out, 0, 0, width, height);
+            });
+            return;
+        }
+
+        // Strip *i* starts at sample *i*strip_samples* of the output; only
+        // the last strip may be shorter
+        const uint64_t n_samples = static_cast<uint64_t>(get_n_samples(frame));
+        const uint64_t strip_samples = strip_height(ifd)
+            * static_cast<uint64_t>(ifd.width * ifd.samples_per_pixel);
+
+        // Whether strips can skip the intermediate buffer and conversion
+        const bool in_place = decodes_in_place<T>(ifd);
+
+        // Strips stored back to back are read in as few requests as possible
+        if(coalesces(ifd)){
+            std::vector<StripRun> runs;
+            add_strip_runs(
+                ifd,
+                0,
+                n_samples,
+                max_run_size(n_samples * static_cast<uint64_t>(ifd.bits_per_sample / 8)),
+                runs
+            );
+            read_runs<T>(runs, out);
+            return;
+        }
+
+        for_each_chunk(ifd.strip_offsets.size(), [&](uint64_t strip, DecodeContext& ctx){
+            const uint64_t start = strip * strip_samples;
+            if(start>=n_samples){
+                return;
+            }
+            decode_strip<T>(
+                ifd,
+                frame,
+                strip,
+                ctx,
+                out + start,
+                std::min(strip_samples, n_samples - start),
+                in_place
+            );
+        });
+    }
+
+
+    /*
+     *  Method: read_frames
+     *  -------------------
+     *  Read *count* consecutive frames, starting at *first*, into one
+     *  array, frame after frame. Uncompressed strips that are contiguous
+     *  in the file are read together even across frame boundaries, so a
+     *  stack written in order is read with a handful of large requests.
+     *  Other frames are decoded as in read_frame.
+     *
+     *  Parameters
+     *  ----------
+     *    T     :   type of the destination array
+     *    first :   index of the first frame to read
+     *    count :   number of frames to read
+     *    out   :   allocated array holding the get_n_samples() of all
+     *              *count* frames
+    */
+    template <typename T>
+    void read_frames(int first, int count, T* out){
+        uint64_t total_size = 0;
+        for(int frame=first; frame<first+count; ++frame){
+            const IFD& ifd = get_ifd(frame);
+            if(coalesces(ifd)){
+                total_size += static_cast<uint64_t>(get_n_samples(frame))
+                    * static_cast<uint64_t>(ifd.bits_per_sample / 8);
+            }
+        }
+        const uint64_t max_size = max_run_size(total_size);
+
+        std::vector<StripRun> runs;
+        uint64_t out_start = 0;
+        for(int frame=first; frame<first+count; ++frame){
+            const IFD& ifd = get_ifd(frame);
+            const uint64_t n_samples = static_cast<uint64_t>(get_n_samples(frame));
+            if(coalesces(ifd)){
+                add_strip_runs(ifd, out_start, n_samples, max_size, runs);
+            } else{
+                read_frame<T>(frame, out + out_start);
+            }
+            out_start += n_samples;
+        }
+        read_runs<T>(runs, out);
+    }
+
+
+    /*
+     *  Method: read_frame_batch
+     *  ------------------------
+     *  Read any set of frames into one array, frame after frame in the
+     *  order given. With IO_URING, the strips and tiles of all the frames
+     *  are requested from the file at once, keeping many reads in flight
+     *  for random access on fast disks. Each chunk is decoded on the
+     *  calling thread as soon as its read completes or, with a thread
+     *  pool, across the pool once every read is done.
+     *
+     *  Compressed chunks are held in memory until decoded, so the batch
+     *  needs as much scratch space as its frames take up in the file.
+     *  With any other io_mode, this reads the frames one by one with
+     *  read_frame.
+     *
+     *  Parameters
+     *  ----------
+     *    T         :   type of the destination array
+     *    frames    :   indices of the frames to read, in any order
+     *    n_frames  :   number of indices in *frames*
+     *    out       :   allocated array holding the get_n_samples() of
+     *                  all the frames
+    */
+    template <typename T>
+    void read_frame_batch(const int* frames, int n_frames, T* out){
+        if(!src->batches_reads()){
+            uint64_t out_start = 0;
+            for(int i=0; i<n_frames; ++i){
+                read_frame<T>(frames[i], out + out_start);
+                out_start += static_cast<uint64_t>(get_n_samples(frames[i]));
+            }
+            return;
+        }
+
+        // One strip or tile to read and decode
+        struct BatchChunk {
+            const IFD* ifd;
+            int frame;
+            uint64_t chunk;
+
+            // For tiles, the frame's first sample; for strips, the strip's
+            // first sample and the most samples to write there
+            T* out;
+            uint64_t n_samples;
+
+            // True if the chunk is read straight into *out* (uncompressed
+            // strips that need no conversion); otherwise it is staged
+            bool direct;
+        };
+        std::vector<BatchChunk> chunks;
+        std::vector<ReadRequest> requests;
+        uint64_t staging_size = 0;
+        uint64_t out_start = 0;
+        for(int i=0; i<n_frames; ++i){
+            const int frame = frames[i];
+            const IFD& ifd = get_ifd(frame);
+            const uint64_t n_samples = static_cast<uint64_t>(get_n_samples(frame));
+            T* frame_out = out + out_start;
+            out_start += n_samples;
+
+            const bool tiled = is_tiled(ifd);
+            const bool in_place = decodes_in_place<T>(ifd) && (ifd.compression==COMPRESSION_NONE);
+            const uint64_t strip_samples = tiled ? 0 : strip_height(ifd)
+                * static_cast<uint64_t>(ifd.width * ifd.samples_per_pixel);
+            for(uint64_t chunk=0; chunk<ifd.strip_offsets.size(); ++chunk){
+                // A missing byte count is left for load_chunk to report
+                const uint64_t byte_count = (chunk<ifd.strip_byte_counts.size())
+                    ? ifd.strip_byte_counts[chunk] : 0;
+                if(tiled){
+                    chunks.push_back(BatchChunk{&ifd, frame, chunk, frame_out, 0, false});
+                    requests.push_back(ReadRequest{ifd.strip_offsets[chunk], byte_count, nullptr});
+                    staging_size += byte_count;
+                    continue;
+                }
+                const uint64_t start = chunk * strip_samples;
+                if(start>=n_samples){
+                    break;
+                }
+                const uint64_t count = std::min(strip_samples, n_samples - start);
+                T* dst = frame_out + start;
+                if(in_place){
+                    // As in decode_strip, never read past the strip's share of *out*
+                    const uint64_t size = std::min(byte_count, count * sizeof(T));
+                    chunks.push_back(BatchChunk{&ifd, frame, chunk, dst, count, true});
+                    requests.push_back(ReadRequest{
+                        ifd.strip_offsets[chunk], size, reinterpret_cast<char*>(dst)
+                    });
+                } else{
+                    chunks.push_back(BatchChunk{&ifd, frame, chunk, dst, count, false});
+                    requests.push_back(ReadRequest{ifd.strip_offsets[chunk], byte_count, nullptr});
+                    staging_size += byte_count;
+                }
+            }
+        }
+
+        std::vector<char> staging(static_cast<size_t>(staging_size));
+        uint64_t staging_offset = 0;
+        for(size_t i=0; i<requests.size(); ++i){
+            if(!chunks[i].direct){
+                requests[i].dst = staging.data() + staging_offset;
+                staging_offset += requests[i].size;
+            }
+        }
+
+        auto decode = [&](size_t i, DecodeContext& ctx){
+            const BatchChunk& c = chunks[i];
+            const IFD& ifd = *c.ifd;
+            if(c.direct){
+                swap_in_place(ifd, c.out, requests[i].size / sizeof(T));
+                return;
+            }
+            ctx.staged = requests[i].dst;
+            ctx.staged_offset = requests[i].offset;
+            ctx.staged_size = requests[i].size;
+            try{
+                if(is_tiled(ifd)){
+                    decode_tile<T>(ifd, c.frame, c.chunk, ctx, c.out, 0, 0,
+                        static_cast<uint64_t>(ifd.width), static_cast<uint64_t>(ifd.height));
+                } else{
+                    decode_strip<T>(ifd, c.frame, c.chunk, ctx, c.out, c.n_samples, false);
+                }
+            } catch(...){
+                ctx.staged = nullptr;
+                throw;
+            }
+            ctx.staged = nullptr;
+        };
+
+        if(!pool){
+            ContextLease ctx(*this);
+            read_source_batch(requests.data(), requests.size(), [&](size_t i){
+                decode(i, *ctx);
+            });
+            return;
+        }
+        read_source_batch(requests.data(), requests.size(), [](size_t){});
+        for_each_chunk(chunks.size(), [&](uint64_t i, DecodeContext& ctx){
+            decode(static_cast<size_t>(i), ctx);
+        });
+    }
+
+
+    /*
+     *  Method: view_frame
+     *  ------------------
+     *  Return a pointer to the samples of a frame inside the memory
+     *  mapping of the file, so that it can be used without any copy, or
+     *  nullptr if the frame is not stored that way. A frame can be viewed
+     *  with IO_MMAP when it is uncompressed and untiled, its strips are
+     *  back to back, and its samples are exactly of type T, in the host's
+     *  byte order and aligned for T.
+     *
+     *  The samples are laid out as read_frame would write them, and must
+     *  not be modified. They stay valid as long as the reader or its
+     *  get_source() is kept alive.
+    */
+    template <typename T>
+    const T* view_frame(int frame) const{
+        const IFD& ifd = get_ifd(frame);
+        if(
+            (!src->is_mapped())
+            || is_tiled(ifd)
+            || (ifd.compression!=COMPRESSION_NONE)
+            || (!decodes_in_place<T>(ifd))
+            || (swap_bytes() && (sizeof(T)>1))
+            || ifd.strip_offsets.empty()
+            || (ifd.strip_byte_counts.size()<ifd.strip_offsets.size())
+        ){
+            return nullptr;
+        }
+
+        // Each strip must hold all of its rows and start right where the
+        // rows of the previous one end
+        const uint64_t frame_size = static_cast<uint64_t>(get_n_samples(frame)) * sizeof(T);
+        const uint64_t strip_size = strip_height(ifd)
+            * static_cast<uint64_t>(ifd.width * ifd.samples_per_pixel) * sizeof(T);
+        const uint64_t offset = ifd.strip_offsets[0];
+        uint64_t covered = 0;
+        for(size_t strip=0; (strip<ifd.strip_offsets.size()) && (covered<frame_size); ++strip){
+            if(ifd.strip_offsets[strip]!=offset+covered){
+                return nullptr;
+            }
+            const uint64_t expected = std::min(strip_size, frame_size - covered);
+            if(ifd.strip_byte_counts[strip]<expected){
+                return nullptr;
+            }
+            covered += expected;
+        }
+        if(covered<frame_size){
+            return nullptr;
+        }
+        const char* ptr = src->view(offset, frame_size);
+        if(reinterpret_cast<uintptr_t>(ptr) % alignof(T)){
+            return nullptr;
+        }
+        return reinterpret_cast<const T*>(ptr);
+    }
+
+
+    /*
+     *  Method: view_frames
+     *  -------------------
+     *  Like view_frame, for *count* frames starting at *first*, which must
+     *  have the same shape and lie at a constant distance from each other
+     *  in the file (as in stacks written frame after frame, with an IFD
+     *  between frames or not). Returns the first frame's samples and sets
+     *  *stride* to the distance between frames in bytes, or returns
+     *  nullptr if the frames cannot be viewed together.
+    */
+    template <typename T>
+    const T* view_frames(int first, int count, uint64_t& stride) const{
+        stride = 0;
+        if(count<=0){
+            return nullptr;
+        }
+        const T* first_ptr = view_frame<T>(first);
+        if(!first_ptr){
+            return nullptr;
+        }
+        const IFD& first_ifd = get_ifd(first);
+        const char* base = reinterpret_cast<const char*>(first_ptr);
+        for(int i=1; i<count; ++i){
+            const IFD& ifd = get_ifd(first + i);
+            if(
+                (ifd.width!=first_ifd.width)
+                || (ifd.height!=first_ifd.height)
+                || (ifd.samples_per_pixel!=first_ifd.samples_per_pixel)
+            ){
+                return nullptr;
+            }
+            const T* ptr = view_frame<T>(first + i);
+            if(!ptr){
+                return nullptr;
+            }
+            const char* p = reinterpret_cast<const char*>(ptr);
+            if(p<=base){
+                return nullptr;
+            }
+            const uint64_t distance = static_cast<uint64_t>(p - base);
+            if(i==1){
+                stride = distance;
+            } else if(distance!=stride * static_cast<uint64_t>(i)){
+                return nullptr;
+            }
+        }
+        if(count==1){
+            stride = static_cast<uint64_t>(get_n_samples(first)) * sizeof(T);
+        }
+        return first_ptr;
+    }
+
+
+    /*
+     *  Method: read_region
+     *  -------------------
+     *  Read a rectangular window of a single frame into memory. Only the
+     *  strips or tiles that overlap the window are read and decoded; for
+     *  uncompressed strips, only the rows inside the window are read.
+     *
+     *  Parameters
+     *  ----------
+     *    T         :   type of the destination array
+     *    frame     :   index of the target frame (from 0 to n_frames-1)
+     *    x0, y0    :   column and row of the window's top left pixel
+     *    width     :   number of columns in the window
+     *    height    :   number of rows in the window
+     *    out       :   allocated array of size
+     *                  *width * height * samples_per_pixel*, filled row by
+     *                  row like the output of read_frame
+    */
+    template <typename T>
+    void read_region(
+        int frame,
+        uint64_t x0,
+        uint64_t y0,
+        uint64_t width,
+        uint64_t height,
+        T* out
+    ){
+        const IFD& ifd = get_ifd(frame);
+        const uint64_t image_width = static_cast<uint64_t>(ifd.width);
+        const uint64_t image_height = static_cast<uint64_t>(ifd.height);
+        if(
+            (x0>image_width) || (width>image_width-x0)
+            || (y0>image_height) || (height>image_height-y0)
+        ){
+            throw std::runtime_error(
+                std::string("region ") + std::to_string(width) + std::string("x")
+                + std::to_string(height) + std::string(" at (") + std::to_string(x0)
+                + std::string(", ") + std::to_string(y0)
+                + std::string(") does not fit in frame ") + std::to_string(frame)
+            );
+        }
+        if((width==0) || (height==0)){
+            return;
+        }
+
+        // Strips or tiles that overlap the window
+        std::vector<uint64_t> chunks;
+        if(is_tiled(ifd)){
+            const uint64_t tile_width = static_cast<uint64_t>(ifd.tile_width);
+            const uint64_t tile_length = static_cast<uint64_t>(ifd.tile_length);
+            for(uint64_t ty=y0/tile_length; ty<=(y0+height-1)/tile_length; ++ty){
+                for(uint64_t tx=x0/tile_width; tx<=(x0+width-1)/tile_width; ++tx){
+                    chunks.push_back(ty*tiles_across(ifd) + tx);
+                }
+            }
+            for_each_chunk(chunks.size(), [&](uint64_t i, DecodeContext& ctx){
+                decode_tile<T>(ifd, frame, chunks[i], ctx, out, x0, y0, width, height);
+            });
+        } else{
+            const uint64_t rows = strip_height(ifd);
+            for(uint64_t strip=y0/rows; strip<=(y0+height-1)/rows; ++strip){
+                chunks.push_back(strip);
+            }
+            for_each_chunk(chunks.size(), [&](uint64_t i, DecodeContext& ctx){
+                decode_strip_region<T>(ifd, frame, chunks[i], ctx, out, x0, y0, width, height);
+            });
+        }
+    }
+
+
+    /*
+     *  Method: for_each_chunk
+     *  ----------------------
+     *  Call fn(chunk, ctx) for every strip or tile index in [0, n_chunks),
+     *  each with a DecodeContext to decode with. Chunks are spread across
+     *  the thread pool when there is one and more than one chunk;
+     *  otherwise they run serially on the caller with a single context.
+    */
+    template <typename F>
+    void for_each_chunk(uint64_t n_chunks, const F& fn){
+        if(pool && (n_chunks>1)){
+            pool->parallel_for(n_chunks, [&](size_t chunk){
+                ContextLease ctx(*this);
+                fn(static_cast<uint64_t>(chunk), *ctx);
+            });
+        } else{
+            ContextLease ctx(*this);
+            for(uint64_t chunk=0; chunk<n_chunks; ++chunk){
+                fn(chunk, *ctx);
+            }
+        }
+    }
+
+
+    /*
+     *  Method: coalesces
+     *  -----------------
+     *  True if the strips of *ifd* may be gathered into StripRuns:
+     *  coalescing is enabled, and the strips are uncompressed and hold
+     *  whole-byte samples.
+    */
+    bool coalesces(const IFD& ifd) const{
+        return (coalesce_bytes>0)
+            && (!is_tiled(ifd))
+            && (ifd.compression==COMPRESSION_NONE)
+            && (ifd.bits_per_sample>=8)
+            && (ifd.bits_per_sample%8==0);
+    }
+
+
+    /*
+     *  Largest StripRun to build when *total_size* bytes are to be read:
+     *  coalesce_bytes, but small enough that every thread of the pool
+     *  gets a run to work on.
+    */
+    uint64_t max_run_size(uint64_t total_size) const{
+        if(!pool){
+            return coalesce_bytes;
+        }
+        const uint64_t n_threads = static_cast<uint64_t>(pool->size());
+        return std::min(coalesce_bytes, std::max<uint64_t>((total_size + n_threads - 1) / n_threads, 1));
+    }
+
+
+    /*
+     *  Method: add_strip_runs
+     *  ----------------------
+     *  Append the strips of one frame to *runs*, extending the last run
+     *  for every strip that follows it directly in both the file and the
+     *  output and has the same sample type, up to *max_size* bytes.
+     *
+     *  Parameters
+     *  ----------
+     *    ifd       :   IFD of the frame (see coalesces)
+     *    out_start :   index of the frame's first sample in the output
+     *    n_samples :   number of samples in the frame
+     *    max_size  :   largest run to build, in bytes (see max_run_size)
+     *    runs      :   runs to append to
+    */
+    void add_strip_runs(
+        const IFD& ifd,
+        uint64_t out_start,
+        uint64_t n_samples,
+        uint64_t max_size,
+        std::vector<StripRun>& runs
+    ) const{
+        const uint64_t sample_size = static_cast<uint64_t>(ifd.bits_per_sample / 8);
+        const uint64_t strip_samples = strip_height(ifd)
+            * static_cast<uint64_t>(ifd.width * ifd.samples_per_pixel);
+        const uint64_t n_strips = std::min(
+            ifd.strip_offsets.size(),
+            ifd.strip_byte_counts.size()
+        );
+        for(uint64_t strip=0; strip<n_strips; ++strip){
+            const uint64_t start = strip * strip_samples;
+            if(start>=n_samples){
+                break;
+            }
+
+            // As in decode_strip, never read past the strip's share of the
+            // output; a short strip leaves the rest of its share untouched
+            const uint64_t offset = ifd.strip_offsets[strip];
+            const uint64_t size = std::min(
+                ifd.strip_byte_counts[strip],
+                std::min(strip_samples, n_samples - start) * sample_size
+            );
+            if(!runs.empty()){
+                StripRun& last = runs.back();
+                if(
+                    (last.offset+last.size==offset)
+                    && (last.out_start+last.size/sample_size==out_start+start)
+                    && (last.size%sample_size==0)
+                    && (last.ifd->bits_per_sample==ifd.bits_per_sample)
+                    && (last.ifd->sample_format==ifd.sample_format)
+                    && (last.size+size<=max_size)
+                ){
+                    last.size += size;
+                    continue;
+                }
+            }
+            runs.push_back(StripRun{&ifd, offset, size, out_start + start});
+        }
+    }
+
+
+    /*
+     *  Method: read_runs
+     *  -----------------
+     *  Read and convert StripRuns built by add_strip_runs, with one read
+     *  per run. Runs are spread across the thread pool like strips.
+    */
+    template <typename T>
+    void read_runs(const std::vector<StripRun>& runs, T* out){
+        for_each_chunk(runs.size(), [&](uint64_t i, DecodeContext& ctx){
+            const StripRun& run = runs[i];
+            const IFD& ifd = *run.ifd;
+            T* dst = out + run.out_start;
+            if(decodes_in_place<T>(ifd)){
+                read_source(run.offset, run.size, reinterpret_cast<char*>(dst));
+                swap_in_place(ifd, dst, run.size / sizeof(T));
+                return;
+            }
+            const char* raw = fetch(
+                run.offset,
+                run.size,
+                src->is_mapped() ? nullptr : ctx.get_strip_buffer(run.size)
+            );
+            const unsigned count = static_cast<unsigned>(run.size * 8 / ifd.bits_per_sample);
+            const uint64_t start = stats.start();
+            convert_strip<T>(ifd, raw, dst, count);
+            stats.add_convert(start, count);
+        });
+    }
+
+
+    /*
+     *  Method: decodes_in_place
+     *  ------------------------
+     *  Return true if the samples of frames described by *ifd* have
+     *  exactly the type T in the file, so that strips can be read or
+     *  inflated directly into the caller's buffer. If the file's byte
+     *  order differs from the host's, the samples are then swapped in
+     *  place.
+     *
+     *  The sample type follows BitsPerSample and SampleFormat. Files
+     *  that omit SampleFormat keep the historical interpretation of
+     *  64-bit samples as doubles.
+    */
+    template <typename T>
+    bool decodes_in_place(const IFD& ifd) const{
+        switch(ifd.bits_per_sample){
+            case 8:
+                if(ifd.sample_format==SAMPLE_FORMAT_INT){
+                    return std::is_same<T, int8_t>::value;
+                }
+                return std::is_same<T, uint8_t>::value;
+            case 16:
+                if(ifd.sample_format==SAMPLE_FORMAT_INT){
+                    return std::is_same<T, int16_t>::value;
+                }
+                return std::is_same<T, uint16_t>::value;
+            case 32:
+                if(ifd.sample_format==SAMPLE_FORMAT_IEEEFP){
+                    return std::is_same<T, float>::value;
+                } else if(ifd.sample_format==SAMPLE_FORMAT_INT){
+                    return std::is_same<T, int32_t>::value;
+                }
+                return std::is_same<T, uint32_t>::value;
+            case 64:
+                if(ifd.sample_format==SAMPLE_FORMAT_INT){
+                    return std::is_same<T, int64_t>::value;
+                } else if(ifd.sample_format==SAMPLE_FORMAT_UINT){
+                    return std::is_same<T, uint64_t>::value;
+                }
+                return std::is_same<T, double>::value;
+            default:
+                return false;
+        }
+    }
+
+
+    /*
+     *  Method: convert_strip
+     *  ---------------------
+     *  Convert *count* raw samples of a decompressed strip to T, picking
+     *  the file's sample type the same way as decodes_in_place.
+     *  *raw* must come from load_chunk.
+    */
+    template <typename T>
+    void convert_strip(const IFD& ifd, const char* raw, T* out, unsigned count) const{
+        // Samples that went through a predictor are already in host order
+        const bool hbe = host_is_big_endian;
+        const bool fbe = swaps_samples(ifd) ? file_is_big_endian : hbe;
+        const int fmt = ifd.sample_format;
+        switch(ifd.bits_per_sample){
+            case 8:
+                if(fmt==SAMPLE_FORMAT_INT){
+                    _parse_array<int8_t, T>(count, hbe, fbe, raw, out);
+                } else{
+                    _parse_array<uint8_t, T>(count, hbe, fbe, raw, out);
+                }
+                break;
+            case 16:
+                if(fmt==SAMPLE_FORMAT_INT){
+                    _parse_array<int16_t, T>(count, hbe, fbe, raw, out);
+                } else{
+                    _parse_array<uint16_t, T>(count, hbe, fbe, raw, out);
+                }
+                break;
+            case 32:
+                if(fmt==SAMPLE_FORMAT_IEEEFP){
+                    _parse_array<float, T>(count, hbe, fbe, raw, out);
+                } else if(fmt==SAMPLE_FORMAT_INT){
+                    _parse_array<int32_t, T>(count, hbe, fbe, raw, out);
+                } else{
+                    _parse_array<uint32_t, T>(count, hbe, fbe, raw, out);
+                }
+                break;
+            case 64:
+                if(fmt==SAMPLE_FORMAT_INT){
+                    _parse_array<int64_t, T>(count, hbe, fbe, raw, out);
+                } else if(fmt==SAMPLE_FORMAT_UINT){
+                    _parse_array<uint64_t, T>(count, hbe, fbe, raw, out);
+                } else{
+                    _parse_array<double, T>(count, hbe, fbe, raw, out);
+                }
+                break;
+            default:
+                throw std::runtime_error(
+                    std::string("unsupported bits_per_sample ")
+                    + std::to_string(ifd.bits_per_sample)
                 );
-            } else if(ifd.bits_per_sample==64){
-                _parse_array<double, T>(
-                    uncompressed_strip_size,
-                    host_is_big_endian,
-                    file_is_big_endian,
-                    strip_buffer,
-                    out                   
+        }
+    }
+
+
+    /*
+     *  Method: decode_strip
+     *  --------------------
+     *  Read, decompress, and convert a single strip.
+     *
+     *  Parameters
+     *  ----------
+     *    T         :   type of the destination array
+     *    ifd       :   IFD of the frame the strip belongs to
+     *    frame     :   index of that frame (used for error messages)
+     *    strip     :   index of the strip in the IFD
+     *    ctx       :   scratch buffers and inflate state to decode with
+     *    out       :   destination for the strip's first sample
+     *    n_samples :   maximum number of samples to write to *out*
+     *    in_place  :   true if the file's samples can be stored in *out*
+     *                  without conversion (see decodes_in_place)
+    */
+    template <typename T>
+    void decode_strip(
+        const IFD& ifd,
+        int frame,
+        uint64_t strip,
+        DecodeContext& ctx,
+        T* out,
+        uint64_t n_samples,
+        bool in_place
+    ){
+        // Fast path: when *out* already has the file's sample type,
+        // read or inflate straight into it and fix the byte order there
+        const uint64_t out_size = n_samples * sizeof(T);
+        if(in_place && (ifd.compression==COMPRESSION_NONE)){
+            const uint64_t size = std::min(ifd.strip_byte_counts.at(strip), out_size);
+            read_source(ifd.strip_offsets.at(strip), size, reinterpret_cast<char*>(out));
+            swap_in_place(ifd, out, size / sizeof(T));
+            return;
+        }
+
+        // Room for a full strip is needed, in case the last strip is padded
+        const bool direct = in_place && (chunk_size(ifd)<=out_size);
+        uint64_t size = 0;
+        const char* raw = load_chunk(
+            ifd,
+            frame,
+            strip,
+            ctx,
+            direct ? reinterpret_cast<char*>(out) : nullptr,
+            size
+        );
+        if(direct){
+            swap_in_place(ifd, out, std::min(size / sizeof(T), n_samples));
+            return;
+        }
+
+        // Number of samples to decode
+        const unsigned count = static_cast<unsigned>(std::min(
+            n_samples,
+            size * 8 / ifd.bits_per_sample
+        ));
+
+        const uint64_t start = stats.start();
+        convert_strip<T>(ifd, raw, out, count);
+        stats.add_convert(start, count);
+    }
+
+
+    /*
+     *  Method: decode_strip_region
+     *  ---------------------------
+     *  Decode the part of a single strip that falls inside a window of
+     *  the frame (see read_region). Uncompressed strips are only read
+     *  from the first to the last row inside the window.
+     *
+     *  Parameters
+     *  ----------
+     *    T         :   type of the destination array
+     *    ifd       :   IFD of the frame the strip belongs to
+     *    frame     :   index of that frame
+     *    strip     :   index of the strip in the IFD
+     *    ctx       :   scratch buffers and inflate state to decode with
+     *    out       :   destination for the whole window
+     *    x0, y0, width, height :   the window, in pixels
+    */
+    template <typename T>
+    void decode_strip_region(
+        const IFD& ifd,
+        int frame,
+        uint64_t strip,
+        DecodeContext& ctx,
+        T* out,
+        uint64_t x0,
+        uint64_t y0,
+        uint64_t width,
+        uint64_t height
+    ){
+        const uint64_t spp = static_cast<uint64_t>(ifd.samples_per_pixel);
+        const uint64_t sample_size = static_cast<uint64_t>(ifd.bits_per_sample / 8);
+        const uint64_t row_size = static_cast<uint64_t>(ifd.width) * spp * sample_size;
+        const uint64_t rows = strip_height(ifd);
+
+        // Rows of the image covered by both the strip and the window
+        const uint64_t first = std::max(y0, strip*rows);
+        const uint64_t last = std::min(y0 + height, (strip+1)*rows);
+        if(first>=last){
+            return;
+        }
+
+        // *raw* holds the strip from row *raw_row* onwards
+        const char* raw = nullptr;
+        uint64_t raw_row = strip*rows;
+        uint64_t size = 0;
+        if(ifd.compression==COMPRESSION_NONE){
+            if(strip>=std::min(ifd.strip_offsets.size(), ifd.strip_byte_counts.size())){
+                throw std::runtime_error(
+                    std::string("frame ") + std::to_string(frame)
+                    + std::string(" has no strip ") + std::to_string(strip)
                 );
             }
-            out += uncompressed_strip_size;
+            const uint64_t begin = (first - raw_row) * row_size;
+            const uint64_t byte_count = ifd.strip_byte_counts[strip];
+            if(begin>=byte_count){
+                return;
+            }
+            size = std::min((last - first) * row_size, byte_count - begin);
+            raw = fetch(
+                ifd.strip_offsets[strip] + begin,
+                size,
+                src->is_mapped() ? nullptr : ctx.get_strip_buffer(size)
+            );
+            raw_row = first;
+        } else{
+            raw = load_chunk(ifd, frame, strip, ctx, nullptr, size);
+        }
+
+        const uint64_t row_samples = width * spp;
+        const uint64_t convert_start = stats.start();
+        uint64_t row = first;
+        for(; row<last; ++row){
+            const uint64_t start = (row - raw_row) * row_size + x0 * spp * sample_size;
+            if(start + row_samples*sample_size > size){
+                break;
+            }
+            convert_strip<T>(
+                ifd,
+                raw + start,
+                out + (row - y0) * row_samples,
+                static_cast<unsigned>(row_samples)
+            );
+        }
+        stats.add_convert(convert_start, (row - first) * row_samples);
+    }
+
+
+    /*
+     *  Method: decode_tile
+     *  -------------------
+     *  Read, decompress, and convert a single tile, copying the part of
+     *  it that lies inside a window of the frame into *out*. read_frame
+     *  uses a window covering the whole frame.
+     *
+     *  Parameters
+     *  ----------
+     *    T         :   type of the destination array
+     *    ifd       :   IFD of the frame the tile belongs to
+     *    frame     :   index of that frame
+     *    tile      :   index of the tile in the IFD
+     *    ctx       :   scratch buffers and inflate state to decode with
+     *    out       :   destination for the whole window
+     *    x0, y0, width, height :   the window, in pixels
+    */
+    template <typename T>
+    void decode_tile(
+        const IFD& ifd,
+        int frame,
+        uint64_t tile,
+        DecodeContext& ctx,
+        T* out,
+        uint64_t x0,
+        uint64_t y0,
+        uint64_t width,
+        uint64_t height
+    ){
+        const uint64_t tile_width = static_cast<uint64_t>(ifd.tile_width);
+        const uint64_t tile_length = static_cast<uint64_t>(ifd.tile_length);
+        const uint64_t spp = static_cast<uint64_t>(ifd.samples_per_pixel);
+        const uint64_t tile_x = (tile % tiles_across(ifd)) * tile_width;
+        const uint64_t tile_y = (tile / tiles_across(ifd)) * tile_length;
+
+        // Intersection of the tile and the window. Tiles are always stored
+        // at full size, so this also skips the padding of tiles on the
+        // right and bottom edges of the image.
+        const uint64_t col0 = std::max(x0, tile_x);
+        const uint64_t col1 = std::min(x0 + width, tile_x + tile_width);
+        const uint64_t row0 = std::max(y0, tile_y);
+        const uint64_t row1 = std::min(y0 + height, tile_y + tile_length);
+        if((col0>=col1) || (row0>=row1)){
+            return;
+        }
+
+        TileCache::Buffer cached;
+        uint64_t size = 0;
+        const char* raw = load_tile(ifd, frame, tile, ctx, cached, size);
+
+        const uint64_t sample_size = static_cast<uint64_t>(ifd.bits_per_sample / 8);
+        const uint64_t row_size = tile_width * spp * sample_size;
+        const uint64_t row_samples = (col1 - col0) * spp;
+        const uint64_t convert_start = stats.start();
+        uint64_t row = row0;
+        for(; row<row1; ++row){
+            const uint64_t start = (row - tile_y) * row_size + (col0 - tile_x) * spp * sample_size;
+            if(start + row_samples*sample_size > size){
+                break;
+            }
+            convert_strip<T>(
+                ifd,
+                raw + start,
+                out + ((row - y0) * width + (col0 - x0)) * spp,
+                static_cast<unsigned>(row_samples)
+            );
+        }
+        stats.add_convert(convert_start, (row - row0) * row_samples);
+    }
+
+
+    /*
+     *  Method: load_tile
+     *  -----------------
+     *  Return the decompressed bytes of a tile, from the tile cache if
+     *  possible. Uncompressed tiles bypass the cache, since reading them
+     *  again costs no more than copying them.
+     *
+     *  Parameters
+     *  ----------
+     *    ifd, frame, tile, ctx :   as for decode_tile
+     *    hold      :   output; keeps a cached tile alive while in use
+     *    size      :   output; number of decompressed bytes
+    */
+    const char* load_tile(
+        const IFD& ifd,
+        int frame,
+        uint64_t tile,
+        DecodeContext& ctx,
+        TileCache::Buffer& hold,
+        uint64_t& size
+    ){
+        if((ifd.compression==COMPRESSION_NONE) || (tile_cache.get_capacity()==0)){
+            return load_chunk(ifd, frame, tile, ctx, nullptr, size);
+        }
+        const std::pair<uint64_t, uint64_t> key(static_cast<uint64_t>(frame), tile);
+        hold = tile_cache.get(key);
+        if(!hold){
+            std::shared_ptr<std::vector<char>> buffer(new std::vector<char>(chunk_size(ifd)));
+            load_chunk(ifd, frame, tile, ctx, buffer->data(), size);
+            buffer->resize(size);
+            hold = buffer;
+            tile_cache.put(key, hold);
+        }
+        size = hold->size();
+        return hold->data();
+    }
+
+
+    /*
+     *  Method: load_chunk
+     *  ------------------
+     *  Read a single strip or tile and decompress it if necessary.
+     *
+     *  Parameters
+     *  ----------
+     *    ifd       :   IFD of the frame the chunk belongs to
+     *    frame     :   index of that frame (used for error messages)
+     *    chunk     :   index of the strip or tile in the IFD
+     *    ctx       :   scratch buffers and inflate state to decode with
+     *    dst       :   buffer of at least chunk_size(ifd) bytes to decode
+     *                  into, or nullptr to use one of ctx's buffers
+     *    size      :   output; number of decompressed bytes
+     *
+     *  Returns
+     *  -------
+     *    pointer to the decompressed bytes. This is *dst* (when given),
+     *    except for uncompressed chunks of memory-mapped files, which are
+     *    returned as a pointer into the mapping.
+    */
+    const char* load_chunk(
+        const IFD& ifd,
+        int frame,
+        uint64_t chunk,
+        DecodeContext& ctx,
+        char* dst,
+        uint64_t& size
+    ){
+        if((chunk>=ifd.strip_offsets.size()) || (chunk>=ifd.strip_byte_counts.size())){
+            throw std::runtime_error(
+                std::string("frame ") + std::to_string(frame)
+                + std::string(" has no strip or tile ") + std::to_string(chunk)
+            );
+        }
+        const uint64_t offset = ifd.strip_offsets[chunk];
+        const uint64_t byte_count = ifd.strip_byte_counts[chunk];
+
+        if(ifd.compression==COMPRESSION_NONE){
+            size = byte_count;
+            if(dst){
+                size = std::min(byte_count, chunk_size(ifd));
+                const char* raw = fetch_chunk(ctx, offset, size, dst);
+                if(raw!=dst){
+                    std::memcpy(dst, raw, size);
+                }
+                return dst;
+            }
+            return fetch_chunk(
+                ctx,
+                offset,
+                byte_count,
+                src->is_mapped() ? nullptr : ctx.get_strip_buffer(byte_count)
+            );
+        }
+        if(!is_supported_compression(ifd.compression)){
+            throw std::runtime_error(
+                std::string("unsupported compression type ")
+                + std::to_string(ifd.compression)
+            );
+        }
+
+        // When the file is memory-mapped, decompress straight from the mapping
+        const char* compressed = fetch_chunk(
+            ctx,
+            offset,
+            byte_count,
+            src->is_mapped() ? nullptr : ctx.get_compressed_buffer(byte_count)
+        );
+        const uint64_t max_size = chunk_size(ifd);
+        char* out = dst ? dst : ctx.get_strip_buffer(max_size);
+        const uint64_t start = stats.start();
+        unsigned written = 0;
+        bool ok = false;
+        if(ifd.compression==COMPRESSION_DEFLATE){
+            ok = ctx.get_deflate_decompressor().decompress(
+                compressed,
+                static_cast<unsigned>(byte_count),
+                out,
+                written,
+                static_cast<unsigned>(max_size)
+            )==Z_OK;
+        } else if(ifd.compression==COMPRESSION_LZW){
+            ok = ctx.get_lzw_decompressor().decompress(
+                compressed,
+                static_cast<unsigned>(byte_count),
+                out,
+                written,
+                static_cast<unsigned>(max_size)
+            );
+        } else if(ifd.compression==COMPRESSION_PACKBITS){
+            ok = packbits_decompress(
+                compressed,
+                static_cast<unsigned>(byte_count),
+                out,
+                written,
+                static_cast<unsigned>(max_size)
+            );
+        }
+#if defined(PITIFFUL_HAVE_ZSTD)
+        else if(ifd.compression==COMPRESSION_ZSTD){
+            ok = ctx.get_zstd_decompressor().decompress(
+                compressed,
+                static_cast<unsigned>(byte_count),
+                out,
+                written,
+                static_cast<unsigned>(max_size)
+            );
+        }
+#endif
+        if(!ok){
+            throw std::runtime_error(
+                std::string("failed to decompress strip/tile ") + std::to_string(chunk)
+                + std::string(" of frame ") + std::to_string(frame)
+            );
+        }
+        size = written;
+        if(has_predictor(ifd)){
+            undo_predictor(ifd, out, size, ctx);
+        }
+        stats.add_decompress(start, byte_count, size);
+        return out;
+    }
+
+
+    /*
+     *  Method: undo_predictor
+     *  ----------------------
+     *  Undo the Predictor (tag 317) of a decompressed strip or tile in
+     *  place, one row at a time. Either predictor leaves the samples in
+     *  host byte order (see swaps_samples). A trailing partial row, which
+     *  only a truncated strip would have, is left alone.
+     *
+     *  Parameters
+     *  ----------
+     *    ifd       :   IFD of the frame the chunk belongs to
+     *    data      :   decompressed bytes
+     *    size      :   number of bytes in *data*
+     *    ctx       :   scratch buffers to decode with
+    */
+    void undo_predictor(const IFD& ifd, char* data, uint64_t size, DecodeContext& ctx) const{
+        const uint64_t spp = static_cast<uint64_t>(ifd.samples_per_pixel);
+        const uint64_t sample_size = static_cast<uint64_t>(ifd.bits_per_sample / 8);
+        const uint64_t row_samples = spp * static_cast<uint64_t>(
+            is_tiled(ifd) ? ifd.tile_width : ifd.width
+        );
+        const uint64_t row_size = row_samples * sample_size;
+        if(row_size==0){
+            return;
+        }
+        const uint64_t n_rows = size / row_size;
+
+        if(ifd.predictor==PREDICTOR_HORIZONTAL){
+            // Differences are taken between samples, not bytes, so the
+            // byte order has to be fixed first
+            if(swap_bytes()){
+                const uint64_t count = n_rows * row_samples;
+                switch(sample_size){
+                    case 2:
+                        convert_samples<uint16_t, uint16_t>(data, reinterpret_cast<uint16_t*>(data), count, true);
+                        break;
+                    case 4:
+                        convert_samples<uint32_t, uint32_t>(data, reinterpret_cast<uint32_t*>(data), count, true);
+                        break;
+                    case 8:
+                        convert_samples<uint64_t, uint64_t>(data, reinterpret_cast<uint64_t*>(data), count, true);
+                        break;
+                }
+            }
+            undo_horizontal_predictor(data, n_rows, row_samples, spp, sample_size);
+        } else if(ifd.predictor==PREDICTOR_FLOATING_POINT){
+            undo_floating_point_predictor(
+                data,
+                n_rows,
+                row_samples,
+                spp,
+                sample_size,
+                ctx.get_predictor_buffer(row_size),
+                host_is_big_endian
+            );
+        } else{
+            throw std::runtime_error(
+                std::string("unsupported predictor ")
+                + std::to_string(ifd.predictor)
+            );
+        }
+    }
+
+
+    /* Byte-swap *count* samples of *ifd* already in *out*, if needed */
+    template <typename T>
+    void swap_in_place(const IFD& ifd, T* out, uint64_t count) const{
+        if(swaps_samples(ifd) && (sizeof(T)>1)){
+            const uint64_t start = stats.start();
+            convert_samples<T, T>(reinterpret_cast<const char*>(out), out, count, true);
+            stats.add_convert(start, count);
         }
     }
 
@@ -555,113 +2564,139 @@ public:
      *  -------
      *    IFD, image file directory metadata
     */
-    IFD parse_ifd(uint64_t byte_offset){
+    IFD parse_ifd(uint64_t byte_offset) const{
         IFD ifd;
         ifd.byte_offset = byte_offset;
-        char* c = &ifd_parse_buffer[0];
 
-        // Go to the start of the IFD
-        s.seekg(byte_offset, s.beg);
+        const bool swap = swap_bytes();
+        const uint64_t field_size = ifd_field_size();
+        const uint64_t local_size = offset_size();
 
-        // First 2 bytes encode the count (number of fields)
-        s.read(c, 2);
-        ifd.count = *reinterpret_cast<uint16_t*>(c);
+        // First 2 bytes (8 for BigTIFF) encode the count (number of fields)
+        char count_bytes[8];
+        ifd.count = parse_ifd_count(fetch(byte_offset, ifd_count_size(), count_bytes));
 
         // Read the field array
-        s.read(c, 12*ifd.count+4);
+        uint64_t field_array_size = field_size*ifd.count + offset_size();
+        std::unique_ptr<char[]> field_array;
+        if(!src->is_mapped()){
+            field_array.reset(new char[field_array_size]);
+        }
+        const char* c = fetch(byte_offset+ifd_count_size(), field_array_size, field_array.get());
         uint16_t ftag, ftype;
-        uint32_t fcount, fsize;
-
-        // Parse each field in the field array
-        for(uint16_t i=0; i<ifd.count; ++i){
-            ftag = parse_int_field<uint16_t>(3, c+12*i);
-            ftype = parse_int_field<uint16_t>(3, c+12*i+2);
-            fcount = parse_int_field<uint32_t>(4, c+12*i+4);
-
-            // Recognized single-value TIFF tags. Currently, these must be 4
-            // bytes or less, meaning they are stored in the last 4 bytes of
-            // the 12-byte field.
-            if((fcount==1) && (is_local_value(ftype, fcount))){
+        uint64_t fcount, fsize;
+
+        // Parse each field in the field array. Each field holds its tag
+        // (2 bytes), type (2 bytes), count (4 bytes, or 8 for BigTIFF),
+        // and then either the value itself or the offset of the value.
+        for(uint64_t i=0; i<ifd.count; ++i){
+            const char* field = c + field_size*i;
+            const char* value = field + 4 + local_size;
+            ftag = parse_int_field<uint16_t>(3, field, swap);
+            ftype = parse_int_field<uint16_t>(3, field+2, swap);
+            fcount = parse_uint_field<uint64_t>(offset_type(), field+4, swap);
+
+            // Recognized single-value TIFF tags. Currently, these must be
+            // small enough to be stored in the field's value slot.
+            if((fcount==1) && (is_local_value(ftype, fcount, local_size))){
                 switch(ftag){
                     case 256:
-                        ifd.width = parse_int_field<int>(ftype, c+12*i+8);
+                        ifd.width = parse_int_field<int>(ftype, value, swap);
                         break;
                     case 257:
-                        ifd.height = parse_int_field<int>(ftype, c+12*i+8);
+                        ifd.height = parse_int_field<int>(ftype, value, swap);
                         break;
                     case 258:
-                        ifd.bits_per_sample = parse_int_field<int>(ftype, c+12*i+8);
+                        ifd.bits_per_sample = parse_int_field<int>(ftype, value, swap);
                         break;
                     case 259:
-                        ifd.compression = parse_int_field<int>(ftype, c+12*i+8);
+                        ifd.compression = parse_int_field<int>(ftype, value, swap);
                         break;
                     case 262:
-                        ifd.photometric_interpretation = parse_int_field<int>(ftype, c+12*i+8);
+                        ifd.photometric_interpretation = parse_int_field<int>(ftype, value, swap);
                         break;
                     case 277:
-                        ifd.samples_per_pixel = parse_int_field<int>(ftype, c+12*i+8);
+                        ifd.samples_per_pixel = parse_int_field<int>(ftype, value, swap);
                         break;
                     case 278:
-                        ifd.rows_per_strip = parse_int_field<int>(ftype, c+12*i+8);
+                        ifd.rows_per_strip = parse_int_field<int>(ftype, value, swap);
+                        break;
+                    case 317:
+                        ifd.predictor = parse_int_field<int>(ftype, value, swap);
+                        break;
+                    case 322:
+                        ifd.tile_width = parse_int_field<int>(ftype, value, swap);
+                        break;
+                    case 323:
+                        ifd.tile_length = parse_int_field<int>(ftype, value, swap);
+                        break;
+                    case 339:
+                        ifd.sample_format = parse_int_field<int>(ftype, value, swap);
                         break;
                     default:
                         break;
                 }
             }
 
-            // strip offsets
-            if(ftag==273){
-                if(ftype>=5){
-                    throw std::runtime_error("strip offsets must be 8-, 16-, or 32-bit integers");
+            // BitsPerSample and SampleFormat have one value per sample
+            // (e.g. RGB). We only support images whose samples all have
+            // the same type, so just take the first.
+            if((fcount>1) && ((ftag==258) || (ftag==339)) && (is_uint_value(ftype))){
+                const char* first = value;
+                char first_bytes[8];
+                if(!is_local_value(ftype, fcount, local_size)){
+                    first = fetch(
+                        parse_uint_field<uint64_t>(offset_type(), value, swap),
+                        TIFF_FIELD_TYPE_SIZES[ftype-1],
+                        first_bytes
+                    );
                 }
-                fsize = TIFF_FIELD_TYPE_SIZES[ftype-1] * fcount;
-                if(fsize<=4){
-                    ifd.strip_offsets.push_back(parse_int_field<uint64_t>(ftype, c+12*i+8));
+                if(ftag==258){
+                    ifd.bits_per_sample = parse_int_field<int>(ftype, first, swap);
                 } else{
-                    ifd.strip_offsets.resize(fcount, 0);
-                    uint64_t foffset = parse_int_field<uint64_t>(4, c+12*i+8);
-                    std::unique_ptr<char[]> bytes(new char[fsize]);
-                    s.seekg(foffset, s.beg);
-                    s.read(&bytes[0], fsize);
-                    parse_array<uint64_t>(
-                        ftype,
-                        fcount,
-                        host_is_big_endian,
-                        file_is_big_endian,
-                        &bytes[0],
-                        ifd.strip_offsets.data()
-                    );
+                    ifd.sample_format = parse_int_field<int>(ftype, first, swap);
                 }
+            }
 
-            // strip byte counts
-            } else if(ftag==279){
-                if(ftype>=5){
-                    throw std::runtime_error("strip byte counts must be 8-, 16-, or 32-bit integers...\n");
+            // strip or tile offsets, and strip or tile byte counts
+            if((ftag==273) || (ftag==324) || (ftag==279) || (ftag==325)){
+                const bool is_offsets = (ftag==273) || (ftag==324);
+                if(!is_offset_value(ftype)){
+                    throw std::runtime_error(
+                        is_offsets
+                        ? "strip/tile offsets must be 8-, 16-, 32-, or 64-bit unsigned integers"
+                        : "strip/tile byte counts must be 8-, 16-, 32-, or 64-bit unsigned integers"
+                    );
                 }
+                std::vector<uint64_t>& values = is_offsets ? ifd.strip_offsets : ifd.strip_byte_counts;
+                values.resize(fcount, 0);
                 fsize = TIFF_FIELD_TYPE_SIZES[ftype-1] * fcount;
-                if(fsize<=4){
-                    ifd.strip_byte_counts.push_back(parse_int_field<uint64_t>(ftype, c+12*i+8));
-                } else{
-                    ifd.strip_byte_counts.resize(fcount, 0);
-                    uint64_t foffset = parse_int_field<uint64_t>(4, c+12*i+8);
-                    std::unique_ptr<char[]> bytes(new char[fsize]);
-                    s.seekg(foffset, s.beg);
-                    s.read(&bytes[0], fsize);
-                    parse_array<uint64_t>(
-                        ftype,
-                        fcount,
-                        host_is_big_endian,
-                        file_is_big_endian,
-                        &bytes[0],
-                        ifd.strip_byte_counts.data()
-                    );                   
+                const char* bytes = value;
+                std::unique_ptr<char[]> buffer;
+                if(!is_local_value(ftype, fcount, local_size)){
+                    if(!src->is_mapped()){
+                        buffer.reset(new char[fsize]);
+                    }
+                    bytes = fetch(
+                        parse_uint_field<uint64_t>(offset_type(), value, swap),
+                        fsize,
+                        buffer.get()
+                    );
                 }
+                parse_array<uint64_t>(
+                    ftype,
+                    static_cast<uint32_t>(fcount),
+                    host_is_big_endian,
+                    file_is_big_endian,
+                    bytes,
+                    values.data()
+                );
             }
         }
 
-        // Last 4 bytes of the IFD contain the byte offset of the next IFD,
-        // or 0 if this is the last IFD
-        ifd.next_byte_offset = parse_uint_field<uint64_t>(4, c+12*ifd.count);
+        // Last 4 bytes (8 for BigTIFF) of the IFD contain the byte offset
+        // of the next IFD, or 0 if this is the last IFD
+        ifd.next_byte_offset = parse_uint_field<uint64_t>(offset_type(), c+field_size*ifd.count, swap);
 
         return ifd;
     }
@@ -676,29 +2711,30 @@ public:
     void print_tiff_info() const{
         std::cout << "host_is_big_endian: " << host_is_big_endian << std::endl;
         std::cout << "file_is_big_endian: " << file_is_big_endian << std::endl;
+        std::cout << "big_tiff: " << big_tiff << std::endl;
+        const uint64_t n_frames = get_n_frames();
         std::cout << "n_frames: " << n_frames << std::endl;
-        std::cout << "max_strip_size: " << max_strip_size << std::endl;
+        std::cout << "max_strip_size: " << get_max_strip_size() << std::endl;
         for(uint64_t frame=0; frame<n_frames; ++frame){
-            const IFD& ifd = ifds[frame];
+            const IFD& ifd = get_ifd(frame);
             std::cout << "frame " << frame << ":\n";
             std::cout << "  height: " << ifd.height << std::endl;
             std::cout << "  width: " << ifd.width << std::endl;
             std::cout << "  bits_per_sample: " << ifd.bits_per_sample << std::endl;
             std::cout << "  samples_per_pixel: " << ifd.samples_per_pixel << std::endl;
             std::cout << "  rows_per_strip: " << ifd.rows_per_strip << std::endl;
+            std::cout << "  tile_width: " << ifd.tile_width << std::endl;
+            std::cout << "  tile_length: " << ifd.tile_length << std::endl;
             std::cout << "  compression: " << ifd.compression << std::endl;
+            std::cout << "  predictor: " << ifd.predictor << std::endl;
             std::cout << "  photometric_interpretation: " << ifd.photometric_interpretation << std::endl;
+            std::cout << "  sample_format: " << ifd.sample_format << std::endl;
         }
     }
 
 
-    /* Destructor; close the raw filestream */
-    ~TIFFReader(){
-        if(s.is_open()){
-            s.close();
-        }
-        delete deflate_decompressor;
-    }
+    /* Destructor; the raw file is closed when *src* is released */
+    ~TIFFReader(){}
 }; // end TIFFReader
 
 } // end namespace pitifful
@@ -0,0 +1,136 @@
+/* Bounded LRU cache of decoded buffers for pitifful */
+#ifndef _PITIFFUL_CACHE_H
+#define _PITIFFUL_CACHE_H
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace pitifful {
+
+/*
+ *  Class: LRUCache
+ *  ---------------
+ *  Thread-safe map from *Key* to immutable byte buffers, holding at most
+ *  *capacity* bytes. When an insertion would exceed the capacity, the
+ *  least recently used buffers are evicted. A capacity of 0 disables
+ *  the cache: nothing is stored and every lookup misses.
+ *
+ *  Buffers are handed out as shared pointers, so a buffer evicted while
+ *  a caller is still reading it stays alive until that caller is done.
+*/
+template <typename Key>
+class LRUCache {
+public:
+    typedef std::shared_ptr<const std::vector<char>> Buffer;
+
+private:
+    typedef std::pair<Key, Buffer> Entry;
+
+    // Most recently used first
+    std::list<Entry> entries;
+    std::map<Key, typename std::list<Entry>::iterator> index;
+
+    uint64_t capacity;
+    uint64_t used;
+    uint64_t n_hits, n_misses;
+    mutable std::mutex mutex;
+
+    /* Drop least recently used entries until at most *limit* bytes are held */
+    void evict_to(uint64_t limit){
+        while((used>limit) && (!entries.empty())){
+            used -= entries.back().second->size();
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+    }
+
+public:
+    explicit LRUCache(uint64_t capacity = 0):
+        capacity(capacity),
+        used(0),
+        n_hits(0),
+        n_misses(0)
+    {}
+
+    LRUCache(const LRUCache&) = delete;
+    LRUCache& operator=(const LRUCache&) = delete;
+
+    /* Return the buffer stored under *key*, or nullptr if there is none */
+    Buffer get(const Key& key){
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if(it==index.end()){
+            ++n_misses;
+            return nullptr;
+        }
+        ++n_hits;
+        entries.splice(entries.begin(), entries, it->second);
+        return it->second->second;
+    }
+
+    /*
+     *  Method: put
+     *  -----------
+     *  Store *buffer* under *key*, replacing any existing entry. Buffers
+     *  larger than the whole cache are not stored.
+    */
+    void put(const Key& key, Buffer buffer){
+        std::lock_guard<std::mutex> lock(mutex);
+        const uint64_t size = buffer->size();
+        if(size>capacity){
+            return;
+        }
+        auto it = index.find(key);
+        if(it!=index.end()){
+            used -= it->second->second->size();
+            entries.erase(it->second);
+            index.erase(it);
+        }
+        evict_to(capacity - size);
+        entries.emplace_front(key, std::move(buffer));
+        index[key] = entries.begin();
+        used += size;
+    }
+
+    /* Drop every entry (hit and miss counts are kept) */
+    void clear(){
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+        index.clear();
+        used = 0;
+    }
+
+    /* Change the byte budget, evicting entries if it shrinks */
+    void set_capacity(uint64_t bytes){
+        std::lock_guard<std::mutex> lock(mutex);
+        capacity = bytes;
+        evict_to(capacity);
+    }
+
+    /* Getters */
+    uint64_t get_capacity() const{
+        std::lock_guard<std::mutex> lock(mutex);
+        return capacity;
+    }
+    uint64_t get_size() const{
+        std::lock_guard<std::mutex> lock(mutex);
+        return used;
+    }
+    uint64_t get_hits() const{
+        std::lock_guard<std::mutex> lock(mutex);
+        return n_hits;
+    }
+    uint64_t get_misses() const{
+        std::lock_guard<std::mutex> lock(mutex);
+        return n_misses;
+    }
+};
+
+} // end namespace pitifful
+
+#endif
@@ -0,0 +1,491 @@
+/* Sample conversion and byte-swapping kernels for pitifful */
+#ifndef _PITIFFUL_CONVERT_H
+#define _PITIFFUL_CONVERT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// SSE2 is part of the x86-64 baseline. AVX2 kernels are compiled with a
+// function-level target attribute and chosen at run time, so no special
+// compiler flags are needed. Define PITIFFUL_NO_SIMD to use only the
+// scalar code.
+#if !defined(PITIFFUL_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__))
+#  define PITIFFUL_SSE2 1
+#  include <emmintrin.h>
+#  if defined(__GNUC__) || defined(__clang__)
+#    define PITIFFUL_AVX2 1
+#    define PITIFFUL_TARGET_AVX2 __attribute__((target("avx2")))
+#    include <immintrin.h>
+#  endif
+#endif
+
+namespace pitifful {
+
+/*
+ *  Function: byteswap
+ *  ------------------
+ *  Reverse the byte order of an unsigned integer.
+*/
+inline uint8_t byteswap(uint8_t x){return x;}
+inline uint16_t byteswap(uint16_t x){
+    return static_cast<uint16_t>((x >> 8) | (x << 8));
+}
+inline uint32_t byteswap(uint32_t x){
+    return ((x & 0x000000FFu) << 24)
+        | ((x & 0x0000FF00u) << 8)
+        | ((x & 0x00FF0000u) >> 8)
+        | ((x & 0xFF000000u) >> 24);
+}
+inline uint64_t byteswap(uint64_t x){
+    return (static_cast<uint64_t>(byteswap(static_cast<uint32_t>(x))) << 32)
+        | static_cast<uint64_t>(byteswap(static_cast<uint32_t>(x >> 32)));
+}
+
+/* Unsigned integer type with the same size as T */
+template <size_t N> struct uint_of_size;
+template <> struct uint_of_size<1> {typedef uint8_t type;};
+template <> struct uint_of_size<2> {typedef uint16_t type;};
+template <> struct uint_of_size<4> {typedef uint32_t type;};
+template <> struct uint_of_size<8> {typedef uint64_t type;};
+
+
+/*
+ *  Function: load_sample
+ *  ---------------------
+ *  Read one value of type T from possibly unaligned raw bytes,
+ *  reversing its byte order if *swap* is true.
+*/
+template <typename T>
+inline T load_sample(const char* c, bool swap){
+    typedef typename uint_of_size<sizeof(T)>::type U;
+    U u;
+    std::memcpy(&u, c, sizeof(T));
+    if(swap){
+        u = byteswap(u);
+    }
+    T x;
+    std::memcpy(&x, &u, sizeof(T));
+    return x;
+}
+
+
+/*
+ *  Function: cpu_has_avx2
+ *  ----------------------
+ *  Return true if the AVX2 kernels were compiled in and the CPU we are
+ *  running on supports them.
+*/
+inline bool cpu_has_avx2(){
+#if defined(PITIFFUL_AVX2)
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2;
+#else
+    return false;
+#endif
+}
+
+
+#if defined(PITIFFUL_SSE2)
+
+/* SSE2 byte swaps of each 16-, 32-, or 64-bit lane */
+inline __m128i sse2_bswap16(__m128i x){
+    return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+inline __m128i sse2_bswap32(__m128i x){
+    x = sse2_bswap16(x);
+    x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+}
+inline __m128i sse2_bswap64(__m128i x){
+    x = sse2_bswap16(x);
+    x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(0, 1, 2, 3));
+    return _mm_shufflehi_epi16(x, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+/*
+ *  Each SSE2/AVX2 kernel below converts as many whole vectors as fit in
+ *  *n* samples and returns the number of samples it handled; the caller
+ *  finishes the tail with scalar code. SWAP fuses a byte swap of every
+ *  input sample into the load.
+*/
+
+/* 16-bit integer -> float */
+template <bool SWAP, bool SIGNED>
+inline size_t sse2_16_to_f32(const char* in, float* out, size_t n){
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for(; i+8<=n; i+=8){
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2*i));
+        if(SWAP){
+            x = sse2_bswap16(x);
+        }
+        __m128i lo, hi;
+        if(SIGNED){
+            lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+            hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        } else{
+            lo = _mm_unpacklo_epi16(x, zero);
+            hi = _mm_unpackhi_epi16(x, zero);
+        }
+        _mm_storeu_ps(out + i, _mm_cvtepi32_ps(lo));
+        _mm_storeu_ps(out + i + 4, _mm_cvtepi32_ps(hi));
+    }
+    return i;
+}
+
+/* 8-bit unsigned integer -> float */
+inline size_t sse2_u8_to_f32(const char* in, float* out, size_t n){
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for(; i+16<=n; i+=16){
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        __m128i lo = _mm_unpacklo_epi8(x, zero);
+        __m128i hi = _mm_unpackhi_epi8(x, zero);
+        _mm_storeu_ps(out + i, _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_ps(out + i + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_ps(out + i + 8, _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_ps(out + i + 12, _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)));
+    }
+    return i;
+}
+
+/* 8-bit unsigned integer -> 16-bit unsigned integer */
+inline size_t sse2_u8_to_u16(const char* in, uint16_t* out, size_t n){
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for(; i+16<=n; i+=16){
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi8(x, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 8), _mm_unpackhi_epi8(x, zero));
+    }
+    return i;
+}
+
+/* 16-bit unsigned integer -> 32-bit unsigned integer */
+template <bool SWAP>
+inline size_t sse2_u16_to_u32(const char* in, uint32_t* out, size_t n){
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for(; i+8<=n; i+=8){
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2*i));
+        if(SWAP){
+            x = sse2_bswap16(x);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi16(x, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 4), _mm_unpackhi_epi16(x, zero));
+    }
+    return i;
+}
+
+/* 16-bit unsigned integer -> 8-bit unsigned integer (keeps the low byte, like static_cast) */
+template <bool SWAP>
+inline size_t sse2_u16_to_u8(const char* in, uint8_t* out, size_t n){
+    const __m128i low_byte = _mm_set1_epi16(0x00FF);
+    size_t i = 0;
+    for(; i+16<=n; i+=16){
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2*i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2*i + 16));
+        if(SWAP){
+            // Keep the value's low byte, which is the second byte of each
+            // sample in a big-endian file
+            a = _mm_srli_epi16(a, 8);
+            b = _mm_srli_epi16(b, 8);
+        } else{
+            a = _mm_and_si128(a, low_byte);
+            b = _mm_and_si128(b, low_byte);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(a, b));
+    }
+    return i;
+}
+
+/* Byte-swapped copy of 16-, 32-, or 64-bit samples */
+template <size_t SIZE>
+inline size_t sse2_bswap_copy(const char* in, char* out, size_t n){
+    const size_t per_vector = 16 / SIZE;
+    size_t i = 0;
+    for(; i+per_vector<=n; i+=per_vector){
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + SIZE*i));
+        if(SIZE==2){
+            x = sse2_bswap16(x);
+        } else if(SIZE==4){
+            x = sse2_bswap32(x);
+        } else{
+            x = sse2_bswap64(x);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + SIZE*i), x);
+    }
+    return i;
+}
+
+#endif // PITIFFUL_SSE2
+
+
+#if defined(PITIFFUL_AVX2)
+
+/* pshufb mask that reverses the bytes of each SIZE-byte lane */
+template <size_t SIZE>
+PITIFFUL_TARGET_AVX2 inline __m256i avx2_bswap_mask(){
+    if(SIZE==2){
+        return _mm256_setr_epi8(
+            1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+            1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14
+        );
+    } else if(SIZE==4){
+        return _mm256_setr_epi8(
+            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+        );
+    }
+    return _mm256_setr_epi8(
+        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+    );
+}
+
+template <bool SWAP, bool SIGNED>
+PITIFFUL_TARGET_AVX2 inline size_t avx2_16_to_f32(const char* in, float* out, size_t n){
+    const __m256i mask = avx2_bswap_mask<2>();
+    size_t i = 0;
+    for(; i+16<=n; i+=16){
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 2*i));
+        if(SWAP){
+            x = _mm256_shuffle_epi8(x, mask);
+        }
+        __m128i lo = _mm256_castsi256_si128(x);
+        __m128i hi = _mm256_extracti128_si256(x, 1);
+        __m256i a = SIGNED ? _mm256_cvtepi16_epi32(lo) : _mm256_cvtepu16_epi32(lo);
+        __m256i b = SIGNED ? _mm256_cvtepi16_epi32(hi) : _mm256_cvtepu16_epi32(hi);
+        _mm256_storeu_ps(out + i, _mm256_cvtepi32_ps(a));
+        _mm256_storeu_ps(out + i + 8, _mm256_cvtepi32_ps(b));
+    }
+    return i;
+}
+
+PITIFFUL_TARGET_AVX2 inline size_t avx2_u8_to_f32(const char* in, float* out, size_t n){
+    size_t i = 0;
+    for(; i+16<=n; i+=16){
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        __m256i a = _mm256_cvtepu8_epi32(x);
+        __m256i b = _mm256_cvtepu8_epi32(_mm_srli_si128(x, 8));
+        _mm256_storeu_ps(out + i, _mm256_cvtepi32_ps(a));
+        _mm256_storeu_ps(out + i + 8, _mm256_cvtepi32_ps(b));
+    }
+    return i;
+}
+
+PITIFFUL_TARGET_AVX2 inline size_t avx2_u8_to_u16(const char* in, uint16_t* out, size_t n){
+    size_t i = 0;
+    for(; i+32<=n; i+=32){
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        __m256i a = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(x));
+        __m256i b = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(x, 1));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), a);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i + 16), b);
+    }
+    return i;
+}
+
+template <bool SWAP>
+PITIFFUL_TARGET_AVX2 inline size_t avx2_u16_to_u32(const char* in, uint32_t* out, size_t n){
+    const __m256i mask = avx2_bswap_mask<2>();
+    size_t i = 0;
+    for(; i+16<=n; i+=16){
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 2*i));
+        if(SWAP){
+            x = _mm256_shuffle_epi8(x, mask);
+        }
+        __m256i a = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(x));
+        __m256i b = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(x, 1));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), a);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i + 8), b);
+    }
+    return i;
+}
+
+template <bool SWAP>
+PITIFFUL_TARGET_AVX2 inline size_t avx2_u16_to_u8(const char* in, uint8_t* out, size_t n){
+    const __m256i low_byte = _mm256_set1_epi16(0x00FF);
+    size_t i = 0;
+    for(; i+32<=n; i+=32){
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 2*i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 2*i + 32));
+        if(SWAP){
+            a = _mm256_srli_epi16(a, 8);
+            b = _mm256_srli_epi16(b, 8);
+        } else{
+            a = _mm256_and_si256(a, low_byte);
+            b = _mm256_and_si256(b, low_byte);
+        }
+        // packus interleaves the 128-bit lanes of a and b; restore order
+        __m256i packed = _mm256_packus_epi16(a, b);
+        packed = _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), packed);
+    }
+    return i;
+}
+
+template <size_t SIZE>
+PITIFFUL_TARGET_AVX2 inline size_t avx2_bswap_copy(const char* in, char* out, size_t n){
+    const __m256i mask = avx2_bswap_mask<SIZE>();
+    const size_t per_vector = 32 / SIZE;
+    size_t i = 0;
+    for(; i+per_vector<=n; i+=per_vector){
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + SIZE*i));
+        _mm256_storeu_si256(
+            reinterpret_cast<__m256i*>(out + SIZE*i),
+            _mm256_shuffle_epi8(x, mask)
+        );
+    }
+    return i;
+}
+
+#endif // PITIFFUL_AVX2
+
+
+/*
+ *  struct: ConvertKernel
+ *  ---------------------
+ *  Vectorized conversion of raw Tin samples to Tout. run() converts a
+ *  prefix of the input and returns its length; the generic version
+ *  handles nothing and leaves everything to the scalar loop. The
+ *  specializations below cover the hot conversions.
+*/
+template <typename Tin, typename Tout>
+struct ConvertKernel {
+    static size_t run(const char* in, Tout* out, size_t n, bool swap){
+        // Same type: plain copy, or a vectorized byte swap
+        if(std::is_same<Tin, Tout>::value){
+            if(!swap){
+                std::memcpy(out, in, n*sizeof(Tout));
+                return n;
+            }
+            char* dst = reinterpret_cast<char*>(out);
+#if defined(PITIFFUL_AVX2)
+            if((sizeof(Tin)>1) && cpu_has_avx2()){
+                return avx2_bswap_copy<sizeof(Tin)>(in, dst, n);
+            }
+#endif
+#if defined(PITIFFUL_SSE2)
+            if(sizeof(Tin)>1){
+                return sse2_bswap_copy<sizeof(Tin)>(in, dst, n);
+            }
+#endif
+            (void)dst;
+        }
+        return 0;
+    }
+};
+
+#if defined(PITIFFUL_SSE2)
+
+template <>
+struct ConvertKernel<uint16_t, float> {
+    static size_t run(const char* in, float* out, size_t n, bool swap){
+#if defined(PITIFFUL_AVX2)
+        if(cpu_has_avx2()){
+            return swap ? avx2_16_to_f32<true, false>(in, out, n)
+                        : avx2_16_to_f32<false, false>(in, out, n);
+        }
+#endif
+        return swap ? sse2_16_to_f32<true, false>(in, out, n)
+                    : sse2_16_to_f32<false, false>(in, out, n);
+    }
+};
+
+template <>
+struct ConvertKernel<int16_t, float> {
+    static size_t run(const char* in, float* out, size_t n, bool swap){
+#if defined(PITIFFUL_AVX2)
+        if(cpu_has_avx2()){
+            return swap ? avx2_16_to_f32<true, true>(in, out, n)
+                        : avx2_16_to_f32<false, true>(in, out, n);
+        }
+#endif
+        return swap ? sse2_16_to_f32<true, true>(in, out, n)
+                    : sse2_16_to_f32<false, true>(in, out, n);
+    }
+};
+
+template <>
+struct ConvertKernel<uint8_t, float> {
+    static size_t run(const char* in, float* out, size_t n, bool){
+#if defined(PITIFFUL_AVX2)
+        if(cpu_has_avx2()){
+            return avx2_u8_to_f32(in, out, n);
+        }
+#endif
+        return sse2_u8_to_f32(in, out, n);
+    }
+};
+
+template <>
+struct ConvertKernel<uint8_t, uint16_t> {
+    static size_t run(const char* in, uint16_t* out, size_t n, bool){
+#if defined(PITIFFUL_AVX2)
+        if(cpu_has_avx2()){
+            return avx2_u8_to_u16(in, out, n);
+        }
+#endif
+        return sse2_u8_to_u16(in, out, n);
+    }
+};
+
+template <>
+struct ConvertKernel<uint16_t, uint32_t> {
+    static size_t run(const char* in, uint32_t* out, size_t n, bool swap){
+#if defined(PITIFFUL_AVX2)
+        if(cpu_has_avx2()){
+            return swap ? avx2_u16_to_u32<true>(in, out, n)
+                        : avx2_u16_to_u32<false>(in, out, n);
+        }
+#endif
+        return swap ? sse2_u16_to_u32<true>(in, out, n)
+                    : sse2_u16_to_u32<false>(in, out, n);
+    }
+};
+
+template <>
+struct ConvertKernel<uint16_t, uint8_t> {
+    static size_t run(const char* in, uint8_t* out, size_t n, bool swap){
+#if defined(PITIFFUL_AVX2)
+        if(cpu_has_avx2()){
+            return swap ? avx2_u16_to_u8<true>(in, out, n)
+                        : avx2_u16_to_u8<false>(in, out, n);
+        }
+#endif
+        return swap ? sse2_u16_to_u8<true>(in, out, n)
+                    : sse2_u16_to_u8<false>(in, out, n);
+    }
+};
+
+#endif // PITIFFUL_SSE2
+
+
+/*
+ *  Function: convert_samples
+ *  -------------------------
+ *  Convert *count* raw samples of type Tin to Tout with static_cast
+ *  semantics, byte-swapping each input sample first if *swap* is true.
+ *  *in* need not be aligned. Uses a SIMD kernel where one exists and a
+ *  scalar loop for everything else.
+*/
+template <typename Tin, typename Tout>
+inline void convert_samples(const char* in, Tout* out, size_t count, bool swap){
+    size_t i = ConvertKernel<Tin, Tout>::run(in, out, count, swap);
+    if(swap){
+        for(; i<count; ++i){
+            out[i] = static_cast<Tout>(load_sample<Tin>(in + i*sizeof(Tin), true));
+        }
+    } else{
+        for(; i<count; ++i){
+            out[i] = static_cast<Tout>(load_sample<Tin>(in + i*sizeof(Tin), false));
+        }
+    }
+}
+
+} // end namespace pitifful
+
+#endif
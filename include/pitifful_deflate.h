@@ -1,4 +1,4 @@
-/* zlib routines for DEFLATE-compressed TIFFs */
+/* zlib (or libdeflate) routines for DEFLATE-compressed TIFFs */
 #ifndef _PITIFFUL_DEFLATE_H
 #define _PITIFFUL_DEFLATE_H
 
@@ -6,7 +6,11 @@
 #include <fstream>
 #include <cassert>
 #include <cstring>
+#include <vector>
 #include "zlib.h"
+#if defined(PITIFFUL_USE_LIBDEFLATE)
+#  include "libdeflate.h"
+#endif
 
 // MSDOS compatibility
 #if defined(MSDOS) || defined(OS2) || defined(WIN32) || defined(__CYGWIN__)
@@ -20,7 +24,7 @@
 namespace pitifful {
 
 /* interpret and report exit values of zlib ops */
-void zerr(int ret)
+inline void zerr(int ret)
 {
     switch(ret){
         case Z_ERRNO:
@@ -35,24 +39,71 @@ void zerr(int ret)
         case Z_MEM_ERROR:
             std::cerr << "zlib error: out of memory\n";
             break;
+        case Z_BUF_ERROR:
+            std::cerr << "zlib error: output buffer too small\n";
+            break;
         case Z_VERSION_ERROR:
             std::cerr << "zlib error: zlib version mismatch!\n";
     }
 }
 
+/*
+ *  Class: DEFLATEDecompressor
+ *  --------------------------
+ *  Inflates zlib-wrapped DEFLATE data (TIFF compression 8) one strip at
+ *  a time. The decompressor state is allocated on first use and reused
+ *  for every later strip, so a single instance should be kept per
+ *  decoding thread.
+ *
+ *  By default this uses zlib's inflate, resetting the stream between
+ *  strips. zlib-ng built in zlib-compatible mode can be used instead
+ *  simply by compiling and linking against it. Defining
+ *  PITIFFUL_USE_LIBDEFLATE switches to libdeflate, which decompresses
+ *  each strip as a whole buffer and is typically much faster. All
+ *  backends produce identical output.
+*/
 class DEFLATEDecompressor{
     unsigned input_buffer_size;
     unsigned char* inbuffer;
+#if defined(PITIFFUL_USE_LIBDEFLATE)
+    libdeflate_decompressor* decompressor;
+#else
+    z_stream strm;
+    bool initialized;
+#endif
 public:
-    DEFLATEDecompressor(unsigned input_buffer_size):
+    /*
+     *  *input_buffer_size* is only needed when decompressing from a
+     *  std::ifstream; decompressing from memory uses no input buffer.
+    */
+    DEFLATEDecompressor(unsigned input_buffer_size = 0):
         input_buffer_size(input_buffer_size),
-        inbuffer(nullptr)
+        inbuffer(nullptr),
+#if defined(PITIFFUL_USE_LIBDEFLATE)
+        decompressor(nullptr)
+#else
+        initialized(false)
+#endif
     {
-        inbuffer = new unsigned char[input_buffer_size];
+        if(input_buffer_size>0){
+            inbuffer = new unsigned char[input_buffer_size];
+        }
     }
     ~DEFLATEDecompressor(){
         delete[] inbuffer;
+#if defined(PITIFFUL_USE_LIBDEFLATE)
+        if(decompressor){
+            libdeflate_free_decompressor(decompressor);
+        }
+#else
+        if(initialized){
+            inflateEnd(&strm);
+        }
+#endif
     }
+    DEFLATEDecompressor(const DEFLATEDecompressor&) = delete;
+    DEFLATEDecompressor& operator=(const DEFLATEDecompressor&) = delete;
+
     int decompress(
         std::ifstream& source,
         char* out,
@@ -69,55 +120,220 @@ public:
                 + " bytes"
             );
         }
-        int ret;
-        written = 0;
-        z_stream strm;
         if(!source.is_open()){
             throw std::runtime_error("input stream not open");
         }
         source.read(reinterpret_cast<char*>(inbuffer), to_read);
+        return decompress(
+            reinterpret_cast<const char*>(inbuffer),
+            to_read,
+            out,
+            written,
+            max_out_buf_size
+        );
+    }
 
-        /* allocate inflate state */
-        strm.zalloc = Z_NULL;
-        strm.zfree = Z_NULL;
-        strm.opaque = Z_NULL;
-        strm.avail_in = 0;
-        strm.avail_in = to_read;
-        strm.next_in = inbuffer;
-        strm.avail_out = max_out_buf_size;
-        strm.next_out = reinterpret_cast<unsigned char*>(out);
-
-        // Initialize stream
-        ret = inflateInit(&strm);
-        if(ret!=Z_OK){
-            std::cerr << "error with inflateInit: " << ret << "\n";
+    /*
+     *  Decompress *to_read* bytes that are already in memory (for instance,
+     *  in a memory-mapped file). The input is not copied. Returns Z_OK on
+     *  success, in which case *written* holds the decompressed size, or
+     *  a zlib error code otherwise.
+    */
+    int decompress(
+        const char* in,
+        unsigned to_read,
+        char* out,
+        unsigned& written,
+        const unsigned max_out_buf_size
+    ){
+        written = 0;
+#if defined(PITIFFUL_USE_LIBDEFLATE)
+        if(!decompressor){
+            decompressor = libdeflate_alloc_decompressor();
+            if(!decompressor){
+                std::cerr << "error with libdeflate_alloc_decompressor\n";
+                zerr(Z_MEM_ERROR);
+                return Z_MEM_ERROR;
+            }
+        }
+        size_t actual_out = 0;
+        libdeflate_result result = libdeflate_zlib_decompress(
+            decompressor,
+            in,
+            to_read,
+            out,
+            max_out_buf_size,
+            &actual_out
+        );
+        if(result!=LIBDEFLATE_SUCCESS){
+            const int ret = (result==LIBDEFLATE_INSUFFICIENT_SPACE) ? Z_BUF_ERROR : Z_DATA_ERROR;
+            std::cerr << "error with libdeflate_zlib_decompress: " << result << "\n";
             zerr(ret);
             return ret;
         }
+        written = static_cast<unsigned>(actual_out);
+        return Z_OK;
+#else
+        int ret;
 
-        // Decompress
-        ret = inflate(&strm, Z_NO_FLUSH);
+        // Allocate the inflate state on first use, and reset it afterwards
+        if(!initialized){
+            strm.zalloc = Z_NULL;
+            strm.zfree = Z_NULL;
+            strm.opaque = Z_NULL;
+            strm.avail_in = 0;
+            strm.next_in = Z_NULL;
+            ret = inflateInit(&strm);
+            if(ret!=Z_OK){
+                std::cerr << "error with inflateInit: " << ret << "\n";
+                zerr(ret);
+                return ret;
+            }
+            initialized = true;
+        } else{
+            ret = inflateReset(&strm);
+            if(ret!=Z_OK){
+                std::cerr << "error with inflateReset: " << ret << "\n";
+                zerr(ret);
+                return ret;
+            }
+        }
+        strm.avail_in = to_read;
+        strm.next_in = reinterpret_cast<unsigned char*>(const_cast<char*>(in));
+        strm.avail_out = max_out_buf_size;
+        strm.next_out = reinterpret_cast<unsigned char*>(out);
+
+        // Decompress. The whole strip is in memory, so Z_FINISH lets zlib
+        // decode straight to the output without maintaining a window.
+        ret = inflate(&strm, Z_FINISH);
         if(ret!=Z_STREAM_END){
             std::cerr << "error with inflate: " << ret << "\n";
-            if(ret==Z_OK){
+            if((ret==Z_OK) || (ret==Z_BUF_ERROR)){
                 std::cerr << "zlib: stream okay, but incomplete decompression\n";
+                ret = Z_BUF_ERROR;
             } else{
                 zerr(ret);
             }
             return ret;
         }
 
-        // Clean up
-        ret = inflateEnd(&strm);
-        if(ret!=Z_OK){
-            std::cerr << "error with inflateEnd: " << ret << "\n";
-            zerr(ret);
-            return ret;
-        }
-
         // Get number of bytes written
         written = static_cast<unsigned>(strm.total_out);
-        return ret;
+        return Z_OK;
+#endif
+    }
+};
+
+
+/*
+ *  Class: DEFLATECompressor
+ *  ------------------------
+ *  Deflates strips into zlib-wrapped DEFLATE data (TIFF compression 8),
+ *  one whole strip at a time. As with DEFLATEDecompressor, the state is
+ *  allocated on first use and reused, so keep one instance per thread;
+ *  PITIFFUL_USE_LIBDEFLATE switches to libdeflate.
+*/
+class DEFLATECompressor{
+    int level;
+#if defined(PITIFFUL_USE_LIBDEFLATE)
+    libdeflate_compressor* compressor;
+#else
+    z_stream strm;
+    bool initialized;
+#endif
+public:
+    /* *level* is the usual zlib compression level, from 1 to 9 */
+    explicit DEFLATECompressor(int level = Z_DEFAULT_COMPRESSION):
+        level(level),
+#if defined(PITIFFUL_USE_LIBDEFLATE)
+        compressor(nullptr)
+#else
+        initialized(false)
+#endif
+    {}
+    ~DEFLATECompressor(){
+#if defined(PITIFFUL_USE_LIBDEFLATE)
+        if(compressor){
+            libdeflate_free_compressor(compressor);
+        }
+#else
+        if(initialized){
+            deflateEnd(&strm);
+        }
+#endif
+    }
+    DEFLATECompressor(const DEFLATECompressor&) = delete;
+    DEFLATECompressor& operator=(const DEFLATECompressor&) = delete;
+
+    /*
+     *  Compress *size* bytes from *in* into *out*, which is resized to
+     *  the compressed size. Returns Z_OK on success, or a zlib error
+     *  code otherwise.
+    */
+    int compress(const char* in, unsigned size, std::vector<char>& out){
+#if defined(PITIFFUL_USE_LIBDEFLATE)
+        if(!compressor){
+            compressor = libdeflate_alloc_compressor(
+                (level==Z_DEFAULT_COMPRESSION) ? 6 : level
+            );
+            if(!compressor){
+                std::cerr << "error with libdeflate_alloc_compressor\n";
+                zerr(Z_MEM_ERROR);
+                return Z_MEM_ERROR;
+            }
+        }
+        out.resize(libdeflate_zlib_compress_bound(compressor, size));
+        const size_t written = libdeflate_zlib_compress(
+            compressor,
+            in,
+            size,
+            out.data(),
+            out.size()
+        );
+        if(written==0){
+            std::cerr << "error with libdeflate_zlib_compress\n";
+            zerr(Z_BUF_ERROR);
+            return Z_BUF_ERROR;
+        }
+        out.resize(written);
+        return Z_OK;
+#else
+        int ret;
+        if(!initialized){
+            strm.zalloc = Z_NULL;
+            strm.zfree = Z_NULL;
+            strm.opaque = Z_NULL;
+            ret = deflateInit(&strm, level);
+            if(ret!=Z_OK){
+                std::cerr << "error with deflateInit: " << ret << "\n";
+                zerr(ret);
+                return ret;
+            }
+            initialized = true;
+        } else{
+            ret = deflateReset(&strm);
+            if(ret!=Z_OK){
+                std::cerr << "error with deflateReset: " << ret << "\n";
+                zerr(ret);
+                return ret;
+            }
+        }
+        out.resize(deflateBound(&strm, size));
+        strm.avail_in = size;
+        strm.next_in = reinterpret_cast<unsigned char*>(const_cast<char*>(in));
+        strm.avail_out = static_cast<unsigned>(out.size());
+        strm.next_out = reinterpret_cast<unsigned char*>(out.data());
+
+        // deflateBound leaves room for the whole strip in one call
+        ret = deflate(&strm, Z_FINISH);
+        if(ret!=Z_STREAM_END){
+            std::cerr << "error with deflate: " << ret << "\n";
+            zerr(ret);
+            return (ret==Z_OK) ? Z_BUF_ERROR : ret;
+        }
+        out.resize(strm.total_out);
+        return Z_OK;
+#endif
     }
 };
 
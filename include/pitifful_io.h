@@ -0,0 +1,654 @@
+/* File access backends for pitifful */
+#ifndef _PITIFFUL_IO_H
+#define _PITIFFUL_IO_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if !defined(_WIN32)
+#  include <cerrno>
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+// io_uring is used through raw system calls, so only the kernel headers
+// are needed. Define PITIFFUL_NO_IO_URING to leave it out entirely.
+#if defined(__linux__) && !defined(PITIFFUL_NO_IO_URING) && defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#    include <linux/io_uring.h>
+#    include <sys/syscall.h>
+#    include <sys/uio.h>
+#    define PITIFFUL_IO_URING
+#  endif
+#endif
+
+namespace pitifful {
+
+/* Ways of accessing the underlying file (see ReaderOptions::io_mode) */
+static const int IO_STREAM = 0;
+static const int IO_MMAP = 1;
+static const int IO_PREAD = 2;
+static const int IO_URING = 3;
+
+
+/* One read of a batch: *size* bytes at byte *offset* into *dst* */
+struct ReadRequest {
+    uint64_t offset;
+    uint64_t size;
+    char* dst;
+};
+
+/*
+ *  Class: FileSource
+ *  -----------------
+ *  Random-access, read-only view of a file. TIFFReader does all of its
+ *  I/O through one of these, so the access strategy is independent of
+ *  the TIFF parsing logic. All methods may be called from several
+ *  threads at once.
+*/
+class FileSource {
+public:
+    virtual ~FileSource(){}
+
+    /* Copy *size* bytes starting at byte *offset* into *dst* */
+    virtual void read(uint64_t offset, uint64_t size, char* dst) = 0;
+
+    /*
+     *  Return a pointer to *size* bytes starting at byte *offset*, if
+     *  this backend can expose the file contents directly. Otherwise
+     *  return nullptr and the caller must use read() instead.
+    */
+    virtual const char* view(uint64_t /* offset */, uint64_t /* size */){
+        return nullptr;
+    }
+
+    /* True if view() exposes the file contents directly */
+    virtual bool is_mapped() const{return false;}
+
+    /* Total size of the file in bytes */
+    virtual uint64_t size() const = 0;
+
+    /*
+     *  Method: read_batch
+     *  ------------------
+     *  Perform *n* reads, calling on_read(i) on the calling thread as soon
+     *  as request i has completed. Backends that can keep several reads
+     *  in flight (IO_URING) issue them all up front, so on_read overlaps
+     *  with the remaining I/O; the default simply reads them in order.
+     *
+     *  If a read or on_read fails, no further on_read calls are made and
+     *  the first exception is rethrown once no read is still in flight.
+    */
+    virtual void read_batch(
+        const ReadRequest* requests,
+        size_t n,
+        const std::function<void(size_t)>& on_read
+    ){
+        for(size_t i=0; i<n; ++i){
+            read(requests[i].offset, requests[i].size, requests[i].dst);
+            on_read(i);
+        }
+    }
+
+    /* True if read_batch keeps several reads in flight */
+    virtual bool batches_reads() const{return false;}
+
+protected:
+    static void check_bounds(uint64_t offset, uint64_t size, uint64_t file_size){
+        if((offset>file_size) || (size>file_size-offset)){
+            throw std::runtime_error(
+                std::string("cannot access bytes ") + std::to_string(offset)
+                + std::string("-") + std::to_string(offset+size)
+                + std::string("; file is only ") + std::to_string(file_size)
+                + std::string(" bytes")
+            );
+        }
+    }
+};
+
+
+/*
+ *  Class: StreamSource
+ *  -------------------
+ *  FileSource backed by a std::ifstream. Every read is a seekg followed
+ *  by a read into the caller's buffer. The stream has a single file
+ *  position, so concurrent reads are serialized.
+*/
+class StreamSource : public FileSource {
+    std::ifstream s;
+    uint64_t file_size;
+    std::mutex mutex;
+public:
+    StreamSource(const char* path): file_size(0) {
+        s.open(path, std::ios::in | std::ios::binary);
+        if(!s.is_open()){
+            throw std::runtime_error(
+                std::string("failed to open ") + std::string(path)
+            );
+        }
+        s.seekg(0, s.end);
+        file_size = static_cast<uint64_t>(s.tellg());
+        s.seekg(0, s.beg);
+    }
+    ~StreamSource(){
+        if(s.is_open()){
+            s.close();
+        }
+    }
+    void read(uint64_t offset, uint64_t size, char* dst) override{
+        check_bounds(offset, size, file_size);
+        std::lock_guard<std::mutex> lock(mutex);
+        s.seekg(offset, s.beg);
+        s.read(dst, size);
+        if(!s){
+            s.clear();
+            throw std::runtime_error(
+                std::string("failed to read ") + std::to_string(size)
+                + std::string(" bytes at offset ") + std::to_string(offset)
+            );
+        }
+    }
+    uint64_t size() const override{return file_size;}
+};
+
+
+/*
+ *  Class: PReadSource
+ *  ------------------
+ *  FileSource backed by positional reads (pread). There is no shared
+ *  file position, so any number of threads can read at the same time
+ *  without locking.
+*/
+class PReadSource : public FileSource {
+protected:
+    int fd;
+    uint64_t file_size;
+public:
+    PReadSource(const char* path): fd(-1), file_size(0) {
+#if defined(_WIN32)
+        throw std::runtime_error(
+            "positional I/O is not supported on this platform"
+        );
+#else
+        fd = ::open(path, O_RDONLY);
+        if(fd<0){
+            throw std::runtime_error(
+                std::string("failed to open ") + std::string(path)
+            );
+        }
+        struct stat st;
+        if(::fstat(fd, &st)!=0){
+            ::close(fd);
+            throw std::runtime_error(
+                std::string("failed to stat ") + std::string(path)
+            );
+        }
+        file_size = static_cast<uint64_t>(st.st_size);
+#endif
+    }
+    ~PReadSource(){
+#if !defined(_WIN32)
+        if(fd>=0){
+            ::close(fd);
+        }
+#endif
+    }
+    void read(uint64_t offset, uint64_t size, char* dst) override{
+        check_bounds(offset, size, file_size);
+#if !defined(_WIN32)
+        // pread may return fewer bytes than requested, so loop
+        while(size>0){
+            ssize_t n = ::pread(fd, dst, size, static_cast<off_t>(offset));
+            if((n<0) && (errno==EINTR)){
+                continue;
+            }
+            if(n<=0){
+                throw std::runtime_error(
+                    std::string("failed to read ") + std::to_string(size)
+                    + std::string(" bytes at offset ") + std::to_string(offset)
+                );
+            }
+            dst += n;
+            offset += static_cast<uint64_t>(n);
+            size -= static_cast<uint64_t>(n);
+        }
+#endif
+    }
+    uint64_t size() const override{return file_size;}
+};
+
+
+/*
+ *  Class: MmapSource
+ *  -----------------
+ *  FileSource backed by a read-only memory mapping of the whole file.
+ *  view() returns pointers straight into the mapping, so callers can
+ *  parse or decompress file contents without an intermediate copy.
+*/
+class MmapSource : public FileSource {
+    const char* data;
+    uint64_t file_size;
+public:
+    MmapSource(const char* path): data(nullptr), file_size(0) {
+#if defined(_WIN32)
+        throw std::runtime_error(
+            "memory-mapped I/O is not supported on this platform"
+        );
+#else
+        int fd = ::open(path, O_RDONLY);
+        if(fd<0){
+            throw std::runtime_error(
+                std::string("failed to open ") + std::string(path)
+            );
+        }
+        struct stat st;
+        if(::fstat(fd, &st)!=0){
+            ::close(fd);
+            throw std::runtime_error(
+                std::string("failed to stat ") + std::string(path)
+            );
+        }
+        file_size = static_cast<uint64_t>(st.st_size);
+        if(file_size>0){
+            void* addr = ::mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+            if(addr==MAP_FAILED){
+                ::close(fd);
+                throw std::runtime_error(
+                    std::string("failed to memory-map ") + std::string(path)
+                );
+            }
+            data = static_cast<const char*>(addr);
+        }
+
+        // The mapping stays valid after the descriptor is closed
+        ::close(fd);
+#endif
+    }
+    ~MmapSource(){
+#if !defined(_WIN32)
+        if(data){
+            ::munmap(const_cast<char*>(data), file_size);
+        }
+#endif
+    }
+    void read(uint64_t offset, uint64_t size, char* dst) override{
+        check_bounds(offset, size, file_size);
+        std::memcpy(dst, data+offset, size);
+    }
+    const char* view(uint64_t offset, uint64_t size) override{
+        check_bounds(offset, size, file_size);
+        return data + offset;
+    }
+    bool is_mapped() const override{return true;}
+    uint64_t size() const override{return file_size;}
+};
+
+
+#if defined(PITIFFUL_IO_URING)
+
+/*
+ *  Class: IOURing
+ *  --------------
+ *  Minimal wrapper around one io_uring instance: a submission queue and
+ *  a completion queue shared with the kernel. Not thread-safe; each
+ *  batch of reads uses a ring of its own.
+*/
+class IOURing {
+    int ring_fd;
+    unsigned entries;
+
+    // Submission queue
+    void* sq_ptr;
+    size_t sq_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    io_uring_sqe* sqes;
+    size_t sqes_len;
+
+    // Completion queue (may share the submission queue's mapping)
+    void* cq_ptr;
+    size_t cq_len;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe* cqes;
+
+    // Submissions queued since the last call to submit_and_wait
+    unsigned to_submit;
+
+    static unsigned* field(void* base, unsigned offset){
+        return reinterpret_cast<unsigned*>(static_cast<char*>(base) + offset);
+    }
+
+public:
+    /* Set up a ring with room for *entries* reads in flight; throws on failure */
+    explicit IOURing(unsigned entries):
+        ring_fd(-1),
+        entries(0),
+        sq_ptr(MAP_FAILED),
+        sq_len(0),
+        sqes(static_cast<io_uring_sqe*>(MAP_FAILED)),
+        sqes_len(0),
+        cq_ptr(MAP_FAILED),
+        cq_len(0),
+        to_submit(0)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        ring_fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if(ring_fd<0){
+            throw std::runtime_error(
+                std::string("io_uring_setup failed: ") + std::strerror(errno)
+            );
+        }
+        this->entries = params.sq_entries;
+
+        sq_len = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+        cq_len = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+        const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP)!=0;
+        if(single_mmap){
+            sq_len = std::max(sq_len, cq_len);
+        }
+        sq_ptr = ::mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring_fd, IORING_OFF_SQ_RING);
+        if(sq_ptr==MAP_FAILED){
+            release();
+            throw std::runtime_error("failed to map io_uring submission queue");
+        }
+        if(single_mmap){
+            cq_ptr = sq_ptr;
+        } else{
+            cq_ptr = ::mmap(nullptr, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring_fd, IORING_OFF_CQ_RING);
+            if(cq_ptr==MAP_FAILED){
+                release();
+                throw std::runtime_error("failed to map io_uring completion queue");
+            }
+        }
+        sqes_len = params.sq_entries*sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(::mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+        if(sqes==MAP_FAILED){
+            release();
+            throw std::runtime_error("failed to map io_uring submission entries");
+        }
+
+        sq_head = field(sq_ptr, params.sq_off.head);
+        sq_tail = field(sq_ptr, params.sq_off.tail);
+        sq_mask = field(sq_ptr, params.sq_off.ring_mask);
+        sq_array = field(sq_ptr, params.sq_off.array);
+        cq_head = field(cq_ptr, params.cq_off.head);
+        cq_tail = field(cq_ptr, params.cq_off.tail);
+        cq_mask = field(cq_ptr, params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(static_cast<char*>(cq_ptr) + params.cq_off.cqes);
+    }
+
+    ~IOURing(){
+        release();
+    }
+
+    IOURing(const IOURing&) = delete;
+    IOURing& operator=(const IOURing&) = delete;
+
+    void release(){
+        if(sqes!=MAP_FAILED){
+            ::munmap(sqes, sqes_len);
+            sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+        }
+        if((cq_ptr!=MAP_FAILED) && (cq_ptr!=sq_ptr)){
+            ::munmap(cq_ptr, cq_len);
+        }
+        cq_ptr = MAP_FAILED;
+        if(sq_ptr!=MAP_FAILED){
+            ::munmap(sq_ptr, sq_len);
+            sq_ptr = MAP_FAILED;
+        }
+        if(ring_fd>=0){
+            ::close(ring_fd);
+            ring_fd = -1;
+        }
+    }
+
+    /* Maximum number of submissions that can be queued at once */
+    unsigned size() const{return entries;}
+
+    /*
+     *  Queue a vectored read of *iov* from *fd* at *offset*, tagged with
+     *  *user_data*. Returns false if the submission queue is full. *iov*
+     *  must stay valid until the read completes.
+    */
+    bool push_readv(int fd, const iovec* iov, uint64_t offset, uint64_t user_data){
+        const unsigned tail = *sq_tail;
+        if(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= entries){
+            return false;
+        }
+        const unsigned index = tail & *sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(iov);
+        sqe->len = 1;
+        sqe->off = offset;
+        sqe->user_data = user_data;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ++to_submit;
+        return true;
+    }
+
+    /* Submit queued reads and wait until at least *wait_nr* have completed */
+    void submit_and_wait(unsigned wait_nr){
+        while(true){
+            const int ret = static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd,
+                to_submit, wait_nr, IORING_ENTER_GETEVENTS, nullptr, 0));
+            if(ret>=0){
+                to_submit -= std::min(to_submit, static_cast<unsigned>(ret));
+                return;
+            }
+            if((errno!=EINTR) && (errno!=EAGAIN) && (errno!=EBUSY)){
+                throw std::runtime_error(
+                    std::string("io_uring_enter failed: ") + std::strerror(errno)
+                );
+            }
+        }
+    }
+
+    /* Take one completion, if any: the read's *user_data* and result */
+    bool pop(uint64_t& user_data, int& result){
+        const unsigned head = *cq_head;
+        if(head==__atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)){
+            return false;
+        }
+        const io_uring_cqe& cqe = cqes[head & *cq_mask];
+        user_data = cqe.user_data;
+        result = cqe.res;
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+};
+
+#endif // PITIFFUL_IO_URING
+
+
+/*
+ *  Class: URingSource
+ *  ------------------
+ *  PReadSource whose read_batch keeps up to *queue_depth* reads in
+ *  flight through io_uring, so that scattered strip reads keep a fast
+ *  disk busy instead of waiting on one read at a time. Single reads
+ *  still use pread.
+ *
+ *  If io_uring is not compiled in (non-Linux, old kernel headers, or
+ *  PITIFFUL_NO_IO_URING) or the kernel refuses to set up a ring,
+ *  read_batch falls back to the pread loop of FileSource. Each batch
+ *  borrows an idle ring, so batches may run on several threads.
+*/
+class URingSource : public PReadSource {
+#if defined(PITIFFUL_IO_URING)
+    unsigned queue_depth;
+    bool available;
+    std::vector<std::unique_ptr<IOURing>> idle_rings;
+    std::mutex rings_mutex;
+
+    std::unique_ptr<IOURing> take_ring(){
+        {
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            if(!idle_rings.empty()){
+                std::unique_ptr<IOURing> ring = std::move(idle_rings.back());
+                idle_rings.pop_back();
+                return ring;
+            }
+        }
+        return std::unique_ptr<IOURing>(new IOURing(queue_depth));
+    }
+
+    void return_ring(std::unique_ptr<IOURing> ring){
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        idle_rings.push_back(std::move(ring));
+    }
+#endif
+
+public:
+    URingSource(const char* path, unsigned queue_depth = 64):
+        PReadSource(path)
+#if defined(PITIFFUL_IO_URING)
+        , queue_depth(std::max(queue_depth, 1u)),
+        available(false)
+    {
+        try{
+            idle_rings.push_back(take_ring());
+            available = true;
+        } catch(std::runtime_error&){
+            available = false;
+        }
+    }
+#else
+    {
+        (void)queue_depth;
+    }
+#endif
+
+    /* True if read_batch goes through io_uring rather than pread */
+    bool batches_reads() const override{
+#if defined(PITIFFUL_IO_URING)
+        return available;
+#else
+        return false;
+#endif
+    }
+
+    void read_batch(
+        const ReadRequest* requests,
+        size_t n,
+        const std::function<void(size_t)>& on_read
+    ) override{
+#if defined(PITIFFUL_IO_URING)
+        if(!available){
+            FileSource::read_batch(requests, n, on_read);
+            return;
+        }
+        for(size_t i=0; i<n; ++i){
+            check_bounds(requests[i].offset, requests[i].size, file_size);
+        }
+        std::unique_ptr<IOURing> ring = take_ring();
+
+        // Bytes read so far for each request, and the iovec of its read
+        // in flight. Reads longer than 1 GiB are issued in pieces, and
+        // short reads are resubmitted for the remainder.
+        std::vector<uint64_t> done(n, 0);
+        std::vector<iovec> iovs(n);
+        auto push = [&](size_t i){
+            const uint64_t remaining = requests[i].size - done[i];
+            iovs[i].iov_base = requests[i].dst + done[i];
+            iovs[i].iov_len = static_cast<size_t>(std::min<uint64_t>(remaining, 1u << 30));
+            return ring->push_readv(fd, &iovs[i], requests[i].offset + done[i], i);
+        };
+
+        std::exception_ptr error;
+        size_t next = 0;
+        unsigned in_flight = 0;
+        while(((next<n) && (!error)) || (in_flight>0)){
+            while((!error) && (next<n) && (in_flight<ring->size())){
+                if(requests[next].size==0){
+                    // Nothing to read; complete it right away
+                    try{
+                        on_read(next);
+                    } catch(...){
+                        error = std::current_exception();
+                    }
+                    ++next;
+                    continue;
+                }
+                if(!push(next)){
+                    break;
+                }
+                ++next;
+                ++in_flight;
+            }
+            if(in_flight==0){
+                continue;
+            }
+            try{
+                ring->submit_and_wait(1);
+            } catch(...){
+                // The ring is unusable; its reads may still be in flight,
+                // so leak it rather than unmapping buffers under the kernel
+                ring.release();
+                throw;
+            }
+
+            uint64_t user_data;
+            int result;
+            while(ring->pop(user_data, result)){
+                --in_flight;
+                const size_t i = static_cast<size_t>(user_data);
+                if(error){
+                    continue;
+                }
+                if((result==-EINTR) || (result==-EAGAIN)){
+                    push(i);
+                    ++in_flight;
+                    continue;
+                }
+                if(result<=0){
+                    error = std::make_exception_ptr(std::runtime_error(
+                        std::string("failed to read ") + std::to_string(requests[i].size)
+                        + std::string(" bytes at offset ") + std::to_string(requests[i].offset)
+                    ));
+                    continue;
+                }
+                done[i] += static_cast<uint64_t>(result);
+                if(done[i]<requests[i].size){
+                    push(i);
+                    ++in_flight;
+                    continue;
+                }
+                try{
+                    on_read(i);
+                } catch(...){
+                    error = std::current_exception();
+                }
+            }
+        }
+        return_ring(std::move(ring));
+        if(error){
+            std::rethrow_exception(error);
+        }
+#else
+        FileSource::read_batch(requests, n, on_read);
+#endif
+    }
+};
+
+} // end namespace pitifful
+
+#endif
@@ -0,0 +1,182 @@
+/* LZW decompression for pitifful */
+#ifndef _PITIFFUL_LZW_H
+#define _PITIFFUL_LZW_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace pitifful {
+
+/* Indicates LZW compression */
+static const int COMPRESSION_LZW = 5;
+
+/*
+ *  Class: LZWDecompressor
+ *  ----------------------
+ *  Decoder for TIFF LZW strips: MSB-first codes of 9 to 12 bits, with
+ *  Clear (256) and EndOfInformation (257) codes and the "early change"
+ *  of code width required by TIFF6 (page 58).
+ *
+ *  Every string in the LZW table is a copy of bytes that were already
+ *  written to the output, so the table stores each code as an offset
+ *  and length into the output instead of as a chain of prefixes.
+ *  Decoding a code is then a single memcpy, and the table is allocated
+ *  once and reused for every strip.
+*/
+class LZWDecompressor {
+    static const unsigned CLEAR_CODE = 256;
+    static const unsigned EOI_CODE = 257;
+    static const unsigned FIRST_CODE = 258;
+    static const unsigned MAX_CODES = 4096;
+    static const unsigned MIN_WIDTH = 9;
+    static const unsigned MAX_WIDTH = 12;
+
+    // Where the string for each code starts in the output, and its length
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> lengths;
+
+    /*
+     *  Copy a string of *length* bytes that was written earlier in the
+     *  output, given *room* bytes of space at *to*. Strings are short, so
+     *  when there is room we copy whole 8-byte words and let the last one
+     *  run past the end; those bytes are overwritten by later strings.
+     *  The source always starts before *to*, so copying forward is
+     *  correct, but a word can overlap its destination when the source
+     *  ends within 8 bytes of *to*; memmove keeps that defined and still
+     *  compiles to a single load and store.
+    */
+    static void copy_string(uint8_t* to, const uint8_t* from, uint32_t length, uint32_t room){
+        if(length+8<=room){
+            for(uint32_t i=0; i<length; i+=8){
+                std::memmove(to+i, from+i, 8);
+            }
+        } else{
+            std::memcpy(to, from, std::min(length, room));
+        }
+    }
+
+public:
+    LZWDecompressor():
+        offsets(MAX_CODES, 0),
+        lengths(MAX_CODES, 0)
+    {}
+
+    LZWDecompressor(const LZWDecompressor&) = delete;
+    LZWDecompressor& operator=(const LZWDecompressor&) = delete;
+
+    /*
+     *  Method: decompress
+     *  ------------------
+     *  Decompress one LZW strip held in memory.
+     *
+     *  Parameters
+     *  ----------
+     *    in        :   compressed bytes
+     *    to_read   :   number of compressed bytes
+     *    out       :   destination for the decompressed bytes
+     *    written   :   output; number of bytes written to *out*
+     *    max       :   size of *out*. Output beyond this is dropped.
+     *
+     *  Returns
+     *  -------
+     *    true on success, false if the stream is corrupt
+    */
+    bool decompress(
+        const char* in,
+        unsigned to_read,
+        char* out,
+        unsigned& written,
+        unsigned max
+    ){
+        const uint8_t* src = reinterpret_cast<const uint8_t*>(in);
+        const uint8_t* src_end = src + to_read;
+        uint8_t* dst = reinterpret_cast<uint8_t*>(out);
+        uint32_t pos = 0;
+
+        uint64_t bits = 0;
+        unsigned n_bits = 0;
+        unsigned width = MIN_WIDTH;
+        unsigned next_code = FIRST_CODE;
+
+        // Location of the previous code's string in the output, or
+        // prev_length = 0 right after a Clear code
+        uint32_t prev_offset = 0, prev_length = 0;
+
+        written = 0;
+        while(pos<max){
+            // Read the next code, MSB first. Running out of input without
+            // an EndOfInformation code is tolerated, as in libtiff.
+            if(n_bits<width){
+                while((n_bits<=56) && (src!=src_end)){
+                    bits = (bits << 8) | *src++;
+                    n_bits += 8;
+                }
+            }
+            if(n_bits<width){
+                break;
+            }
+            n_bits -= width;
+            const unsigned code = static_cast<unsigned>(bits >> n_bits) & ((1u << width) - 1);
+
+            if(code==EOI_CODE){
+                break;
+            }
+            if(code==CLEAR_CODE){
+                width = MIN_WIDTH;
+                next_code = FIRST_CODE;
+                prev_length = 0;
+                continue;
+            }
+
+            // Write the string for *code*
+            const uint32_t start = pos;
+            uint32_t length;
+            if(code<CLEAR_CODE){
+                dst[pos] = static_cast<uint8_t>(code);
+                length = 1;
+            } else if((code<next_code) && (prev_length>0)){
+                length = lengths[code];
+                copy_string(dst+pos, dst+offsets[code], length, max-pos);
+                if(length>max-pos){
+                    length = max-pos;
+                }
+            } else if((code==next_code) && (prev_length>0)){
+                // The string for a code not yet in the table is the
+                // previous string followed by its own first byte
+                length = prev_length + 1;
+                if(length>max-pos){
+                    length = max-pos;
+                }
+                std::memcpy(dst+pos, dst+prev_offset, std::min(length, prev_length));
+                if(length>prev_length){
+                    dst[pos+prev_length] = dst[prev_offset];
+                }
+            } else{
+                written = pos;
+                return false;
+            }
+            pos += length;
+
+            // The new table entry is the previous string plus the first
+            // byte of this one, which is exactly where they sit in the output
+            if((prev_length>0) && (next_code<MAX_CODES)){
+                offsets[next_code] = prev_offset;
+                lengths[next_code] = prev_length + 1;
+                ++next_code;
+                if((next_code>=(1u << width) - 1) && (width<MAX_WIDTH)){
+                    ++width;
+                }
+            }
+            prev_offset = start;
+            prev_length = length;
+        }
+        written = pos;
+        return true;
+    }
+};
+
+} // end namespace pitifful
+
+#endif
@@ -0,0 +1,73 @@
+/* PackBits decompression for pitifful */
+#ifndef _PITIFFUL_PACKBITS_H
+#define _PITIFFUL_PACKBITS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace pitifful {
+
+/* Indicates PackBits compression */
+static const int COMPRESSION_PACKBITS = 32773;
+
+/*
+ *  Function: packbits_decompress
+ *  -----------------------------
+ *  Decompress one PackBits strip held in memory (TIFF6 specification,
+ *  section 9). Each header byte n is followed either by n+1 literal
+ *  bytes (0 <= n <= 127) or by one byte to repeat 1-n times
+ *  (-127 <= n <= -1); n = -128 is a no-op.
+ *
+ *  Parameters
+ *  ----------
+ *    in        :   compressed bytes
+ *    to_read   :   number of compressed bytes
+ *    out       :   destination for the decompressed bytes
+ *    written   :   output; number of bytes written to *out*
+ *    max       :   size of *out*. Output beyond this is dropped.
+ *
+ *  Returns
+ *  -------
+ *    true on success, false if a run is cut short by the end of the input
+*/
+inline bool packbits_decompress(
+    const char* in,
+    unsigned to_read,
+    char* out,
+    unsigned& written,
+    unsigned max
+){
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(in);
+    const uint8_t* src_end = src + to_read;
+    unsigned pos = 0;
+
+    written = 0;
+    while((src<src_end) && (pos<max)){
+        const int n = static_cast<int8_t>(*src++);
+        if(n>=0){
+            const unsigned length = static_cast<unsigned>(n) + 1;
+            if(length>static_cast<unsigned>(src_end-src)){
+                written = pos;
+                return false;
+            }
+            std::memcpy(out+pos, src, std::min(length, max-pos));
+            src += length;
+            pos += std::min(length, max-pos);
+        } else if(n!=-128){
+            if(src==src_end){
+                written = pos;
+                return false;
+            }
+            const unsigned length = static_cast<unsigned>(1-n);
+            std::memset(out+pos, *src++, std::min(length, max-pos));
+            pos += std::min(length, max-pos);
+        }
+    }
+    written = pos;
+    return true;
+}
+
+} // end namespace pitifful
+
+#endif
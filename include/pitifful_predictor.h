@@ -0,0 +1,260 @@
+/* Undoing TIFF predictors (tag 317) for pitifful */
+#ifndef _PITIFFUL_PREDICTOR_H
+#define _PITIFFUL_PREDICTOR_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include "pitifful_convert.h"
+
+namespace pitifful {
+
+/* Values of the Predictor tag (317) */
+static const int PREDICTOR_NONE = 1;
+static const int PREDICTOR_HORIZONTAL = 2;
+static const int PREDICTOR_FLOATING_POINT = 3;
+
+
+#if defined(PITIFFUL_SSE2)
+
+/*
+ *  Inclusive prefix sum of the SIZE-byte lanes of a vector: lane i
+ *  becomes the (wrapping) sum of lanes 0 to i.
+*/
+template <size_t SIZE>
+inline __m128i sse2_prefix_sum(__m128i x){
+    if(SIZE==1){
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+        return _mm_add_epi8(x, _mm_slli_si128(x, 8));
+    } else if(SIZE==2){
+        x = _mm_add_epi16(x, _mm_slli_si128(x, 2));
+        x = _mm_add_epi16(x, _mm_slli_si128(x, 4));
+        return _mm_add_epi16(x, _mm_slli_si128(x, 8));
+    } else if(SIZE==4){
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+        return _mm_add_epi32(x, _mm_slli_si128(x, 8));
+    }
+    return _mm_add_epi64(x, _mm_slli_si128(x, 8));
+}
+
+/* Copy the last SIZE-byte lane of a vector into every lane */
+template <size_t SIZE>
+inline __m128i sse2_broadcast_last(__m128i x){
+    if(SIZE==1){
+        x = _mm_unpackhi_epi8(x, x);
+        x = _mm_shufflehi_epi16(x, 0xFF);
+        return _mm_unpackhi_epi64(x, x);
+    } else if(SIZE==2){
+        x = _mm_shufflehi_epi16(x, 0xFF);
+        return _mm_unpackhi_epi64(x, x);
+    } else if(SIZE==4){
+        return _mm_shuffle_epi32(x, 0xFF);
+    }
+    return _mm_unpackhi_epi64(x, x);
+}
+
+/* Lane-wise wrapping addition of SIZE-byte lanes */
+template <size_t SIZE>
+inline __m128i sse2_add(__m128i a, __m128i b){
+    if(SIZE==1){
+        return _mm_add_epi8(a, b);
+    } else if(SIZE==2){
+        return _mm_add_epi16(a, b);
+    } else if(SIZE==4){
+        return _mm_add_epi32(a, b);
+    }
+    return _mm_add_epi64(a, b);
+}
+
+/*
+ *  Running sum of a row with one sample per pixel, 16 bytes at a time:
+ *  each vector is prefix-summed in registers, then offset by the last
+ *  lane of the previous result. Returns the number of samples done.
+*/
+template <typename U>
+inline size_t sse2_undo_horizontal(U* row, size_t n){
+    const size_t per_vector = 16 / sizeof(U);
+    __m128i carry = _mm_setzero_si128();
+    size_t i = 0;
+    for(; i+per_vector<=n; i+=per_vector){
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        x = sse2_add<sizeof(U)>(sse2_prefix_sum<sizeof(U)>(x), carry);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(row + i), x);
+        carry = sse2_broadcast_last<sizeof(U)>(x);
+    }
+    return i;
+}
+
+/*
+ *  Interleave the byte planes of 16 little-endian 32-bit samples:
+ *  plane 0 holds the most significant byte of each sample.
+*/
+inline void sse2_unshuffle_4(const uint8_t* planes, size_t n, uint8_t* out, size_t k){
+    const __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes + k));
+    const __m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes + n + k));
+    const __m128i p2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes + 2*n + k));
+    const __m128i p3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes + 3*n + k));
+    const __m128i lo32 = _mm_unpacklo_epi8(p3, p2), hi32 = _mm_unpacklo_epi8(p1, p0);
+    const __m128i lo32b = _mm_unpackhi_epi8(p3, p2), hi32b = _mm_unpackhi_epi8(p1, p0);
+    __m128i* dst = reinterpret_cast<__m128i*>(out + 4*k);
+    _mm_storeu_si128(dst, _mm_unpacklo_epi16(lo32, hi32));
+    _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(lo32, hi32));
+    _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(lo32b, hi32b));
+    _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(lo32b, hi32b));
+}
+
+/* Same as sse2_unshuffle_4, for 16 little-endian 64-bit samples */
+inline void sse2_unshuffle_8(const uint8_t* planes, size_t n, uint8_t* out, size_t k){
+    __m128i p[8];
+    for(size_t b=0; b<8; ++b){
+        p[b] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes + b*n + k));
+    }
+    __m128i* dst = reinterpret_cast<__m128i*>(out + 8*k);
+    for(int half=0; half<2; ++half){
+        // Pairs of bytes, then groups of 4, then whole samples
+        const __m128i b76 = half ? _mm_unpackhi_epi8(p[7], p[6]) : _mm_unpacklo_epi8(p[7], p[6]);
+        const __m128i b54 = half ? _mm_unpackhi_epi8(p[5], p[4]) : _mm_unpacklo_epi8(p[5], p[4]);
+        const __m128i b32 = half ? _mm_unpackhi_epi8(p[3], p[2]) : _mm_unpacklo_epi8(p[3], p[2]);
+        const __m128i b10 = half ? _mm_unpackhi_epi8(p[1], p[0]) : _mm_unpacklo_epi8(p[1], p[0]);
+        const __m128i lo_a = _mm_unpacklo_epi16(b76, b54), lo_b = _mm_unpacklo_epi16(b32, b10);
+        const __m128i hi_a = _mm_unpackhi_epi16(b76, b54), hi_b = _mm_unpackhi_epi16(b32, b10);
+        _mm_storeu_si128(dst++, _mm_unpacklo_epi32(lo_a, lo_b));
+        _mm_storeu_si128(dst++, _mm_unpackhi_epi32(lo_a, lo_b));
+        _mm_storeu_si128(dst++, _mm_unpacklo_epi32(hi_a, hi_b));
+        _mm_storeu_si128(dst++, _mm_unpackhi_epi32(hi_a, hi_b));
+    }
+}
+
+#endif // PITIFFUL_SSE2
+
+
+/*
+ *  Function: undo_horizontal_row
+ *  -----------------------------
+ *  Undo horizontal differencing on one row of host-order samples:
+ *  sample i becomes the wrapping sum of itself and sample i-*spp*.
+*/
+template <typename U>
+inline void undo_horizontal_row(U* row, size_t n, size_t spp){
+    size_t i = spp;
+#if defined(PITIFFUL_SSE2)
+    if(spp==1){
+        i = std::max<size_t>(sse2_undo_horizontal<U>(row, n), 1);
+    }
+#endif
+    for(; i<n; ++i){
+        row[i] = static_cast<U>(row[i] + row[i-spp]);
+    }
+}
+
+
+/*
+ *  Function: undo_horizontal_predictor
+ *  -----------------------------------
+ *  Undo Predictor 2 (horizontal differencing) in place. The samples
+ *  must already be in host byte order.
+ *
+ *  Parameters
+ *  ----------
+ *    data          :   decompressed strip or tile
+ *    n_rows        :   number of rows in *data*
+ *    row_samples   :   samples per row (pixels per row * spp)
+ *    spp           :   samples per pixel
+ *    sample_size   :   bytes per sample: 1, 2, 4, or 8
+*/
+inline void undo_horizontal_predictor(
+    char* data,
+    size_t n_rows,
+    size_t row_samples,
+    size_t spp,
+    size_t sample_size
+){
+    for(size_t r=0; r<n_rows; ++r){
+        char* row = data + r*row_samples*sample_size;
+        switch(sample_size){
+            case 1:
+                undo_horizontal_row(reinterpret_cast<uint8_t*>(row), row_samples, spp);
+                break;
+            case 2:
+                undo_horizontal_row(reinterpret_cast<uint16_t*>(row), row_samples, spp);
+                break;
+            case 4:
+                undo_horizontal_row(reinterpret_cast<uint32_t*>(row), row_samples, spp);
+                break;
+            case 8:
+                undo_horizontal_row(reinterpret_cast<uint64_t*>(row), row_samples, spp);
+                break;
+            default:
+                throw std::runtime_error(
+                    std::string("horizontal predictor not supported for ")
+                    + std::to_string(8*sample_size) + std::string("-bit samples")
+                );
+        }
+    }
+}
+
+
+/*
+ *  Function: undo_floating_point_predictor
+ *  ---------------------------------------
+ *  Undo Predictor 3 (floating point) in place. Each row is stored as
+ *  byte planes, most significant byte first, with horizontal
+ *  differencing applied to the bytes. The result is in host byte order
+ *  whatever the byte order of the file.
+ *
+ *  Parameters
+ *  ----------
+ *    data          :   decompressed strip or tile
+ *    n_rows        :   number of rows in *data*
+ *    row_samples   :   samples per row (pixels per row * spp)
+ *    spp           :   samples per pixel
+ *    sample_size   :   bytes per sample
+ *    scratch       :   buffer of at least row_samples*sample_size bytes
+ *    host_be       :   true if the host is big-endian
+*/
+inline void undo_floating_point_predictor(
+    char* data,
+    size_t n_rows,
+    size_t row_samples,
+    size_t spp,
+    size_t sample_size,
+    char* scratch,
+    bool host_be
+){
+    const size_t row_size = row_samples * sample_size;
+    uint8_t* out = reinterpret_cast<uint8_t*>(scratch);
+    for(size_t r=0; r<n_rows; ++r){
+        uint8_t* row = reinterpret_cast<uint8_t*>(data + r*row_size);
+        undo_horizontal_row(row, row_size, spp);
+
+        // Interleave the byte planes back into samples
+        size_t k = 0;
+#if defined(PITIFFUL_SSE2)
+        if((!host_be) && (sample_size==4)){
+            for(; k+16<=row_samples; k+=16){
+                sse2_unshuffle_4(row, row_samples, out, k);
+            }
+        } else if((!host_be) && (sample_size==8)){
+            for(; k+16<=row_samples; k+=16){
+                sse2_unshuffle_8(row, row_samples, out, k);
+            }
+        }
+#endif
+        for(; k<row_samples; ++k){
+            for(size_t b=0; b<sample_size; ++b){
+                const size_t plane = host_be ? b : sample_size-1-b;
+                out[k*sample_size + b] = row[plane*row_samples + k];
+            }
+        }
+        std::memcpy(row, out, row_size);
+    }
+}
+
+} // end namespace pitifful
+
+#endif
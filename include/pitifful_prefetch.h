@@ -0,0 +1,186 @@
+/* Read-ahead of consecutive frames for pitifful */
+#ifndef _PITIFFUL_PREFETCH_H
+#define _PITIFFUL_PREFETCH_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "pitifful.h"
+
+namespace pitifful {
+
+/*
+ *  Class: FramePrefetcher
+ *  ----------------------
+ *  Iterates over the frames *start* to *stop*-1 of a TIFFReader in
+ *  order, reading and decoding them on a background thread while the
+ *  caller works on earlier frames.
+ *
+ *  Frames are decoded into a ring of *depth* reusable buffers, so the
+ *  background thread runs at most *depth*-1 frames ahead of the frame
+ *  the caller holds. The buffer returned by next() stays valid until
+ *  the following call to next(); copy it out to keep it longer.
+ *
+ *  The reader must outlive the prefetcher. It may be used from other
+ *  threads at the same time, and still decodes strips on its own
+ *  thread pool when ReaderOptions::n_threads > 1.
+ *
+ *  Example
+ *  -------
+ *    FramePrefetcher<uint16_t> frames(reader, 4);
+ *    uint64_t frame;
+ *    while(const uint16_t* data = frames.next(frame)){
+ *        process(data, reader.get_n_samples(frame));
+ *    }
+*/
+template <typename T>
+class FramePrefetcher {
+    TIFFReader& reader;
+    const uint64_t start, stop;
+    const uint64_t depth;
+
+    // Frame start+i is decoded into buffers[i % depth]. If that failed,
+    // errors[i % depth] holds the exception to rethrow in next().
+    std::vector<std::vector<T>> buffers;
+    std::vector<std::exception_ptr> errors;
+
+    std::mutex mutex;
+    std::condition_variable frame_ready, slot_free;
+
+    // Counts of frames decoded by the worker, handed to the caller by
+    // next(), and handed back (whose buffers may be reused)
+    uint64_t n_decoded, n_taken, n_released;
+    bool stopping;
+
+    std::thread worker;
+
+    void run(){
+        for(uint64_t i=0; start+i<stop; ++i){
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                slot_free.wait(lock, [&]{return stopping || (i<n_released+depth);});
+                if(stopping){
+                    return;
+                }
+            }
+            const int frame = static_cast<int>(start + i);
+            std::vector<T>& buffer = buffers[i % depth];
+            std::exception_ptr error;
+            try{
+                buffer.resize(static_cast<size_t>(reader.get_n_samples(frame)));
+                reader.read_frame<T>(frame, buffer.data());
+            } catch(...){
+                error = std::current_exception();
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                errors[i % depth] = error;
+                ++n_decoded;
+            }
+            frame_ready.notify_one();
+            if(error){
+                return;
+            }
+        }
+    }
+
+public:
+    /*
+     *  Parameters
+     *  ----------
+     *    reader    :   reader to take frames from
+     *    depth     :   number of frame buffers in the ring (at least 1)
+     *    start     :   first frame to read
+     *    stop      :   one past the last frame to read; clipped to the
+     *                  number of frames in the file
+    */
+    FramePrefetcher(
+        TIFFReader& reader,
+        uint64_t depth = 4,
+        uint64_t start = 0,
+        uint64_t stop = std::numeric_limits<uint64_t>::max()
+    ):
+        reader(reader),
+        start(start),
+        stop(std::max(start, std::min(stop, reader.get_n_frames()))),
+        depth(depth),
+        n_decoded(0),
+        n_taken(0),
+        n_released(0),
+        stopping(false)
+    {
+        if(depth==0){
+            throw std::runtime_error("prefetch depth must be at least 1");
+        }
+        buffers.resize(depth);
+        errors.resize(depth);
+        worker = std::thread(&FramePrefetcher::run, this);
+    }
+
+    ~FramePrefetcher(){
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        slot_free.notify_one();
+        worker.join();
+    }
+
+    FramePrefetcher(const FramePrefetcher&) = delete;
+    FramePrefetcher& operator=(const FramePrefetcher&) = delete;
+
+    /*
+     *  Method: next
+     *  ------------
+     *  Hand back the previous frame's buffer and return the next frame,
+     *  waiting for it only if the background thread has not finished it
+     *  yet. Rethrows any error raised while reading that frame.
+     *
+     *  Parameters
+     *  ----------
+     *    frame :   output; index of the returned frame
+     *
+     *  Returns
+     *  -------
+     *    pointer to get_n_samples(frame) decoded samples, or nullptr once
+     *    every frame has been returned
+    */
+    const T* next(uint64_t& frame){
+        std::unique_lock<std::mutex> lock(mutex);
+        if(n_released<n_taken){
+            n_released = n_taken;
+            slot_free.notify_one();
+        }
+        if(start+n_taken>=stop){
+            return nullptr;
+        }
+        frame_ready.wait(lock, [&]{return n_decoded>n_taken;});
+        const uint64_t slot = n_taken % depth;
+        if(errors[slot]){
+            // The worker stops after an error; so does the iteration
+            std::exception_ptr error = errors[slot];
+            errors[slot] = nullptr;
+            n_taken = stop - start;
+            std::rethrow_exception(error);
+        }
+        frame = start + n_taken;
+        ++n_taken;
+        return buffers[slot].data();
+    }
+
+    /* Getters */
+    uint64_t get_depth() const{return depth;}
+    uint64_t get_start() const{return start;}
+    uint64_t get_stop() const{return stop;}
+};
+
+} // end namespace pitifful
+
+#endif
@@ -0,0 +1,160 @@
+/* Per-stage counters of the work done by a pitifful reader */
+#ifndef _PITIFFUL_STATS_H
+#define _PITIFFUL_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace pitifful {
+
+/*
+ *  struct: ReaderStats
+ *  -------------------
+ *  Work done by a TIFFReader since its stats were last reset, split
+ *  into the three stages of reading a frame: getting bytes from the
+ *  file, decompressing them, and converting samples to the output type.
+ *
+ *  Times are in nanoseconds, summed over all threads. When strips are
+ *  decoded on several threads at once they can therefore add up to
+ *  more than the elapsed time. read_ns includes waiting for other
+ *  threads' reads on the same stream (IO_STREAM).
+*/
+struct ReaderStats {
+    // Reads from the file (requests, for read_frame_batch with io_uring),
+    // the bytes they returned, and the time spent in them
+    uint64_t read_calls = 0;
+    uint64_t read_bytes = 0;
+    uint64_t read_ns = 0;
+
+    // Bytes used straight from the memory mapping (IO_MMAP) instead of
+    // being read. Page faults on these are paid in later stages.
+    uint64_t mapped_bytes = 0;
+
+    // Strips or tiles decompressed, their size before and after, and the
+    // time spent decompressing them and undoing any predictor
+    uint64_t decompress_calls = 0;
+    uint64_t compressed_bytes = 0;
+    uint64_t decompressed_bytes = 0;
+    uint64_t decompress_ns = 0;
+
+    // Samples converted to the output type or byte-swapped in place,
+    // and the time spent doing so
+    uint64_t converted_samples = 0;
+    uint64_t convert_ns = 0;
+};
+
+
+/*
+ *  Class: StatsCounters
+ *  --------------------
+ *  Thread-safe accumulator behind TIFFReader::get_stats. Collection is
+ *  off until set_enabled(true); while off, each stage costs a single
+ *  relaxed load.
+ *
+ *  A stage is measured by taking start() before it and passing that
+ *  value to the matching add_* call afterwards. start() returns 0 while
+ *  collection is off, and the add_* calls ignore a start of 0, so a
+ *  stage that began before collection was turned on is not counted.
+*/
+class StatsCounters {
+private:
+    std::atomic<bool> enabled;
+    std::atomic<uint64_t> read_calls, read_bytes, read_ns, mapped_bytes;
+    std::atomic<uint64_t> decompress_calls, compressed_bytes, decompressed_bytes, decompress_ns;
+    std::atomic<uint64_t> converted_samples, convert_ns;
+
+    static uint64_t now(){
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()
+        ).count());
+    }
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t value){
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+
+public:
+    explicit StatsCounters(bool enabled = false): enabled(enabled){
+        reset();
+    }
+
+    StatsCounters(const StatsCounters&) = delete;
+    StatsCounters& operator=(const StatsCounters&) = delete;
+
+    bool is_enabled() const{
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    void set_enabled(bool on){
+        enabled.store(on, std::memory_order_relaxed);
+    }
+
+    /* Timestamp for the start of a stage, or 0 if collection is off */
+    uint64_t start() const{
+        return is_enabled() ? now() : 0;
+    }
+
+    /* *calls* reads of *bytes* bytes in total, begun at *start* */
+    void add_read(uint64_t start, uint64_t bytes, uint64_t calls = 1){
+        if(start){
+            add(read_ns, now() - start);
+            add(read_bytes, bytes);
+            add(read_calls, calls);
+        }
+    }
+
+    void add_mapped(uint64_t bytes){
+        if(is_enabled()){
+            add(mapped_bytes, bytes);
+        }
+    }
+
+    /* One strip or tile of *compressed* bytes decompressed to *decompressed* */
+    void add_decompress(uint64_t start, uint64_t compressed, uint64_t decompressed){
+        if(start){
+            add(decompress_ns, now() - start);
+            add(compressed_bytes, compressed);
+            add(decompressed_bytes, decompressed);
+            add(decompress_calls, 1);
+        }
+    }
+
+    void add_convert(uint64_t start, uint64_t samples){
+        if(start){
+            add(convert_ns, now() - start);
+            add(converted_samples, samples);
+        }
+    }
+
+    /* Current totals. Counters updated concurrently may be slightly out of step. */
+    ReaderStats snapshot() const{
+        ReaderStats stats;
+        stats.read_calls = read_calls.load(std::memory_order_relaxed);
+        stats.read_bytes = read_bytes.load(std::memory_order_relaxed);
+        stats.read_ns = read_ns.load(std::memory_order_relaxed);
+        stats.mapped_bytes = mapped_bytes.load(std::memory_order_relaxed);
+        stats.decompress_calls = decompress_calls.load(std::memory_order_relaxed);
+        stats.compressed_bytes = compressed_bytes.load(std::memory_order_relaxed);
+        stats.decompressed_bytes = decompressed_bytes.load(std::memory_order_relaxed);
+        stats.decompress_ns = decompress_ns.load(std::memory_order_relaxed);
+        stats.converted_samples = converted_samples.load(std::memory_order_relaxed);
+        stats.convert_ns = convert_ns.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    /* Zero every counter; does not change whether collection is on */
+    void reset(){
+        for(std::atomic<uint64_t>* counter : {
+            &read_calls, &read_bytes, &read_ns, &mapped_bytes,
+            &decompress_calls, &compressed_bytes, &decompressed_bytes, &decompress_ns,
+            &converted_samples, &convert_ns
+        }){
+            counter->store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+} // end namespace pitifful
+
+#endif
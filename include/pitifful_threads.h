@@ -0,0 +1,157 @@
+/* Minimal thread pool used for parallel decoding in pitifful */
+#ifndef _PITIFFUL_THREADS_H
+#define _PITIFFUL_THREADS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace pitifful {
+
+/*
+ *  Class: ThreadPool
+ *  -----------------
+ *  A fixed set of worker threads that cooperatively run the tasks of
+ *  a parallel_for. The calling thread also takes part, so a pool of
+ *  size n keeps n-1 background threads alive.
+ *
+ *  Only one parallel_for runs on a pool at a time. If another thread
+ *  (or a task running on this pool) calls parallel_for while the pool
+ *  is busy, that call simply runs its tasks serially on the caller.
+*/
+class ThreadPool {
+    std::vector<std::thread> workers;
+
+    // Synchronizes hand-off of jobs between the caller and the workers
+    std::mutex mutex;
+    std::condition_variable work_ready, work_done;
+
+    // Current job
+    const std::function<void(size_t)>* job;
+    size_t n_tasks;
+    std::atomic<size_t> next_task;
+    size_t n_busy;
+    uint64_t generation;
+    bool stopping;
+    std::exception_ptr error;
+
+    // Held for the duration of each parallel_for
+    std::mutex run_mutex;
+
+    void run_tasks(){
+        size_t task;
+        while((task = next_task.fetch_add(1)) < n_tasks){
+            try{
+                (*job)(task);
+            } catch(...){
+                std::lock_guard<std::mutex> lock(mutex);
+                if(!error){
+                    error = std::current_exception();
+                }
+                // Skip any tasks that have not started yet
+                next_task = n_tasks;
+            }
+        }
+    }
+
+    void worker_loop(){
+        uint64_t seen = 0;
+        while(true){
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_ready.wait(lock, [&]{return stopping || (generation!=seen);});
+                if(stopping){
+                    return;
+                }
+                seen = generation;
+            }
+            run_tasks();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(--n_busy==0){
+                    work_done.notify_all();
+                }
+            }
+        }
+    }
+
+public:
+    explicit ThreadPool(int n_threads):
+        job(nullptr),
+        n_tasks(0),
+        next_task(0),
+        n_busy(0),
+        generation(0),
+        stopping(false)
+    {
+        for(int i=1; i<n_threads; ++i){
+            workers.emplace_back(&ThreadPool::worker_loop, this);
+        }
+    }
+
+    ~ThreadPool(){
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for(std::thread& worker : workers){
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /* Total number of threads that run tasks, including the caller */
+    int size() const{return static_cast<int>(workers.size()) + 1;}
+
+    /*
+     *  Method: parallel_for
+     *  --------------------
+     *  Call fn(task) for every task in [0, n), spread across the pool.
+     *  Returns once every task has finished. If any task throws, the
+     *  remaining unstarted tasks are skipped and the first exception is
+     *  rethrown here.
+    */
+    void parallel_for(size_t n, const std::function<void(size_t)>& fn){
+        std::unique_lock<std::mutex> run_lock(run_mutex, std::try_to_lock);
+        if(workers.empty() || (n<=1) || (!run_lock.owns_lock())){
+            for(size_t task=0; task<n; ++task){
+                fn(task);
+            }
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &fn;
+            n_tasks = n;
+            next_task = 0;
+            n_busy = workers.size();
+            error = nullptr;
+            ++generation;
+        }
+        work_ready.notify_all();
+        run_tasks();
+        std::exception_ptr err;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            work_done.wait(lock, [&]{return n_busy==0;});
+            job = nullptr;
+            err = error;
+            error = nullptr;
+        }
+        if(err){
+            std::rethrow_exception(err);
+        }
+    }
+};
+
+} // end namespace pitifful
+
+#endif
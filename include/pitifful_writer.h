@@ -0,0 +1,510 @@
+/* Writing multi-frame TIFFs for pitifful */
+#ifndef _PITIFFUL_WRITER_H
+#define _PITIFFUL_WRITER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "pitifful.h"
+
+namespace pitifful {
+
+/* Strip size aimed for when WriterOptions::rows_per_strip is 0, in bytes */
+static const uint64_t DEFAULT_STRIP_BYTES = 1 << 16;
+
+/* Values of the PhotometricInterpretation tag (262) */
+static const int PHOTOMETRIC_MINISBLACK = 1;
+static const int PHOTOMETRIC_RGB = 2;
+
+
+/*
+ *  struct: WriterOptions
+ *  ---------------------
+ *  Construction-time settings for a TIFFWriter.
+*/
+struct WriterOptions {
+    // COMPRESSION_NONE or COMPRESSION_DEFLATE
+    int compression = COMPRESSION_NONE;
+
+    // zlib compression level for DEFLATE, from 1 (fastest) to 9 (smallest)
+    int deflate_level = 6;
+
+    // Number of threads compressing the strips of a frame. 1 compresses
+    // serially; 0 uses one thread per hardware core.
+    int n_threads = 1;
+
+    // Rows in each strip. 0 picks strips of about DEFAULT_STRIP_BYTES.
+    int rows_per_strip = 0;
+
+    // If true, write a BigTIFF from the start. Otherwise a classic TIFF
+    // is written, and converted to BigTIFF if it would outgrow 4 GB.
+    bool big_tiff = false;
+};
+
+
+/*
+ *  Class: TIFFWriter
+ *  -----------------
+ *  Writes a multi-frame TIFF one frame at a time. Each frame's strips
+ *  are written as soon as write_frame is called, followed by its IFD, so
+ *  memory use does not grow with the number of frames beyond one IFD
+ *  per frame.
+ *
+ *  Samples are written in the host's byte order, with BitsPerSample and
+ *  SampleFormat taken from the array type, contiguous (chunky) samples,
+ *  and RGB photometric interpretation for 3 or 4 samples per pixel
+ *  (grayscale otherwise). The file is complete after close(), which the
+ *  destructor also calls.
+ *
+ *  Example
+ *  -------
+ *    WriterOptions options;
+ *    options.compression = COMPRESSION_DEFLATE;
+ *    options.n_threads = 8;
+ *    TIFFWriter writer("out.tif", options);
+ *    for(const std::vector<uint16_t>& frame : frames){
+ *        writer.write_frame<uint16_t>(frame.data(), height, width);
+ *    }
+ *    writer.close();
+*/
+class TIFFWriter {
+private:
+    std::ofstream file;
+    std::string path;
+
+    int compression;
+    int deflate_level;
+    int rows_per_strip;
+
+    // Whether the file is currently laid out as a BigTIFF
+    bool big_tiff;
+    bool host_is_big_endian;
+
+    // Size of the file written so far
+    uint64_t file_end;
+
+    // Location of the pointer to set to the next IFD's offset: in the
+    // header, or in the last IFD written
+    uint64_t next_pointer_pos;
+
+    // IFDs of the frames written so far, kept to rewrite them if the
+    // file is converted to BigTIFF
+    std::vector<IFD> ifds;
+
+    // Workers for compressing the strips of a frame in parallel, or
+    // nullptr when compressing serially
+    std::unique_ptr<ThreadPool> pool;
+
+    // Idle compressors, so that deflate state is allocated once per thread
+    std::vector<std::unique_ptr<DEFLATECompressor>> compressors;
+    std::mutex compressors_mutex;
+
+    // Compressed strips of the frame being written
+    std::vector<std::vector<char>> strip_buffers;
+
+    /* One entry of an IFD, with its values in host byte order */
+    struct Field {
+        uint16_t tag;
+        uint16_t type;
+        uint64_t count;
+        std::vector<char> values;
+    };
+
+    template <typename U>
+    static Field make_field(uint16_t tag, uint16_t type, const std::vector<U>& values){
+        Field field{tag, type, values.size(), std::vector<char>(values.size() * sizeof(U))};
+        std::memcpy(field.values.data(), values.data(), field.values.size());
+        return field;
+    }
+
+    /* Append *size* bytes to the end of the file */
+    void append(const char* data, uint64_t size){
+        file.write(data, static_cast<std::streamsize>(size));
+        if(!file){
+            throw std::runtime_error(std::string("failed to write to ") + path);
+        }
+        file_end += size;
+    }
+
+    /* Pad the file with a zero byte if needed, so the next write starts at an even offset */
+    void align(){
+        if(file_end%2){
+            append("", 1);
+        }
+    }
+
+    /* Overwrite *size* bytes at *offset*, which lies before the end of the file */
+    void patch(uint64_t offset, const char* data, uint64_t size){
+        file.seekp(static_cast<std::streamoff>(offset));
+        file.write(data, static_cast<std::streamsize>(size));
+        file.seekp(static_cast<std::streamoff>(file_end));
+        if(!file){
+            throw std::runtime_error(std::string("failed to write to ") + path);
+        }
+    }
+
+    /* Write the header, whose first-IFD pointer is then set by write_ifd */
+    void write_header(){
+        char header[16] = {0};
+        header[0] = header[1] = host_is_big_endian ? 'M' : 'I';
+        const uint16_t version = big_tiff ? TIFF_VERSION_BIG : TIFF_VERSION_CLASSIC;
+        std::memcpy(header + 2, &version, 2);
+        if(big_tiff){
+            // Size of offsets, followed by a reserved 0
+            const uint16_t offset_size = 8;
+            std::memcpy(header + 4, &offset_size, 2);
+            next_pointer_pos = 8;
+        } else{
+            next_pointer_pos = 4;
+        }
+        patch(0, header, sizeof(header));
+    }
+
+    /* Size in bytes of the IFD written for *ifd* (see write_ifd) */
+    uint64_t ifd_size(const IFD& ifd) const{
+        const std::vector<Field> fields = make_fields(ifd);
+        const uint64_t slot = big_tiff ? 8 : 4;
+        uint64_t size = big_tiff ? (8 + 20*fields.size() + 8) : (2 + 12*fields.size() + 4);
+        for(const Field& field : fields){
+            if(field.values.size()>slot){
+                size += field.values.size() + field.values.size()%2;
+            }
+        }
+        return size;
+    }
+
+    /* Fields describing *ifd*, in increasing order of tag */
+    std::vector<Field> make_fields(const IFD& ifd) const{
+        const uint16_t spp = static_cast<uint16_t>(ifd.samples_per_pixel);
+        const uint16_t n_color = (ifd.photometric_interpretation==PHOTOMETRIC_RGB) ? 3 : 1;
+        const uint16_t SHORT = 3, LONG = 4, LONG8 = 16;
+        std::vector<Field> fields;
+        fields.push_back(make_field<uint32_t>(256, LONG, {static_cast<uint32_t>(ifd.width)}));
+        fields.push_back(make_field<uint32_t>(257, LONG, {static_cast<uint32_t>(ifd.height)}));
+        fields.push_back(make_field<uint16_t>(258, SHORT,
+            std::vector<uint16_t>(spp, static_cast<uint16_t>(ifd.bits_per_sample))));
+        fields.push_back(make_field<uint16_t>(259, SHORT, {static_cast<uint16_t>(ifd.compression)}));
+        fields.push_back(make_field<uint16_t>(262, SHORT,
+            {static_cast<uint16_t>(ifd.photometric_interpretation)}));
+        if(big_tiff){
+            fields.push_back(make_field<uint64_t>(273, LONG8, ifd.strip_offsets));
+        } else{
+            fields.push_back(make_field<uint32_t>(273, LONG,
+                std::vector<uint32_t>(ifd.strip_offsets.begin(), ifd.strip_offsets.end())));
+        }
+        fields.push_back(make_field<uint16_t>(277, SHORT, {spp}));
+        fields.push_back(make_field<uint32_t>(278, LONG, {static_cast<uint32_t>(ifd.rows_per_strip)}));
+        if(big_tiff){
+            fields.push_back(make_field<uint64_t>(279, LONG8, ifd.strip_byte_counts));
+        } else{
+            fields.push_back(make_field<uint32_t>(279, LONG,
+                std::vector<uint32_t>(ifd.strip_byte_counts.begin(), ifd.strip_byte_counts.end())));
+        }
+        // PlanarConfiguration: contiguous samples
+        fields.push_back(make_field<uint16_t>(284, SHORT, {1}));
+        if(spp>n_color){
+            // ExtraSamples: unspecified data
+            fields.push_back(make_field<uint16_t>(338, SHORT, std::vector<uint16_t>(spp - n_color, 0)));
+        }
+        fields.push_back(make_field<uint16_t>(339, SHORT,
+            std::vector<uint16_t>(spp, static_cast<uint16_t>(ifd.sample_format))));
+        return fields;
+    }
+
+    /*
+     *  Method: write_ifd
+     *  -----------------
+     *  Append the IFD for *ifd* at the end of the file, followed by any
+     *  values too large for their entries, and link it from the header
+     *  or the previous IFD.
+    */
+    void write_ifd(const IFD& ifd){
+        align();
+        const std::vector<Field> fields = make_fields(ifd);
+        const uint64_t slot = big_tiff ? 8 : 4;
+        const uint64_t entry_size = big_tiff ? 20 : 12;
+        const uint64_t count_size = big_tiff ? 8 : 2;
+        const uint64_t offset = file_end;
+        const uint64_t entries_size = count_size + entry_size*fields.size() + slot;
+
+        std::vector<char> block(static_cast<size_t>(entries_size), 0);
+        char* c = block.data();
+        if(big_tiff){
+            const uint64_t count = fields.size();
+            std::memcpy(c, &count, 8);
+        } else{
+            const uint16_t count = static_cast<uint16_t>(fields.size());
+            std::memcpy(c, &count, 2);
+        }
+        c += count_size;
+
+        // Values that do not fit in their entry follow the IFD
+        std::vector<char> values;
+        for(const Field& field : fields){
+            std::memcpy(c, &field.tag, 2);
+            std::memcpy(c + 2, &field.type, 2);
+            if(big_tiff){
+                std::memcpy(c + 4, &field.count, 8);
+            } else{
+                const uint32_t count = static_cast<uint32_t>(field.count);
+                std::memcpy(c + 4, &count, 4);
+            }
+            char* value = c + entry_size - slot;
+            if(field.values.size()<=slot){
+                std::memcpy(value, field.values.data(), field.values.size());
+            } else{
+                const uint64_t value_offset = offset + entries_size + values.size();
+                if(big_tiff){
+                    std::memcpy(value, &value_offset, 8);
+                } else{
+                    const uint32_t value_offset32 = static_cast<uint32_t>(value_offset);
+                    std::memcpy(value, &value_offset32, 4);
+                }
+                values.insert(values.end(), field.values.begin(), field.values.end());
+                if(values.size()%2){
+                    values.push_back(0);
+                }
+            }
+            c += entry_size;
+        }
+        block.insert(block.end(), values.begin(), values.end());
+        append(block.data(), block.size());
+
+        // Point the previous IFD (or the header) here
+        if(big_tiff){
+            patch(next_pointer_pos, reinterpret_cast<const char*>(&offset), 8);
+        } else{
+            const uint32_t offset32 = static_cast<uint32_t>(offset);
+            patch(next_pointer_pos, reinterpret_cast<const char*>(&offset32), 4);
+        }
+        next_pointer_pos = offset + count_size + entry_size*fields.size();
+    }
+
+    /*
+     *  Method: convert_to_big_tiff
+     *  ---------------------------
+     *  Switch to BigTIFF before the file outgrows 32-bit offsets. The
+     *  strips stay where they are: the header is rewritten (16 bytes
+     *  were set aside for it) and the IFDs written so far are appended
+     *  again in BigTIFF form, leaving the classic ones unreferenced.
+    */
+    void convert_to_big_tiff(){
+        big_tiff = true;
+        write_header();
+        for(const IFD& ifd : ifds){
+            write_ifd(ifd);
+        }
+    }
+
+    std::unique_ptr<DEFLATECompressor> take_compressor(){
+        {
+            std::lock_guard<std::mutex> lock(compressors_mutex);
+            if(!compressors.empty()){
+                std::unique_ptr<DEFLATECompressor> compressor = std::move(compressors.back());
+                compressors.pop_back();
+                return compressor;
+            }
+        }
+        return std::unique_ptr<DEFLATECompressor>(new DEFLATECompressor(deflate_level));
+    }
+
+    void return_compressor(std::unique_ptr<DEFLATECompressor> compressor){
+        std::lock_guard<std::mutex> lock(compressors_mutex);
+        compressors.push_back(std::move(compressor));
+    }
+
+    /* Value of the SampleFormat tag for samples of type T */
+    template <typename T>
+    static int sample_format_of(){
+        if(std::is_floating_point<T>::value){
+            return SAMPLE_FORMAT_IEEEFP;
+        }
+        return std::is_signed<T>::value ? SAMPLE_FORMAT_INT : SAMPLE_FORMAT_UINT;
+    }
+
+public:
+    TIFFWriter(const char* path, const WriterOptions& options = WriterOptions()):
+        path(path),
+        compression(options.compression),
+        deflate_level(options.deflate_level),
+        rows_per_strip(options.rows_per_strip),
+        big_tiff(options.big_tiff),
+        host_is_big_endian(!determine_if_host_is_little_endian()),
+        file_end(0),
+        next_pointer_pos(0)
+    {
+        if((compression!=COMPRESSION_NONE) && (compression!=COMPRESSION_DEFLATE)){
+            throw std::runtime_error(
+                std::string("cannot write compression type ") + std::to_string(compression)
+            );
+        }
+        file.open(path, std::ios::binary | std::ios::out | std::ios::trunc);
+        if(!file.is_open()){
+            throw std::runtime_error(std::string("could not open ") + path);
+        }
+
+        // Reserve room for a BigTIFF header even in classic TIFFs, so
+        // that they can be converted later
+        const char reserved[16] = {0};
+        append(reserved, sizeof(reserved));
+        write_header();
+
+        int n_threads = options.n_threads;
+        if(n_threads<=0){
+            n_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        }
+        if(n_threads>1){
+            pool.reset(new ThreadPool(n_threads));
+        }
+    }
+
+    ~TIFFWriter(){
+        try{
+            close();
+        } catch(std::exception&){
+            // Nothing sensible to do with the error here; call close()
+            // explicitly to see it
+        }
+    }
+
+    TIFFWriter(const TIFFWriter&) = delete;
+    TIFFWriter& operator=(const TIFFWriter&) = delete;
+
+    /*
+     *  Method: write_frame
+     *  -------------------
+     *  Append a frame to the file.
+     *
+     *  Parameters
+     *  ----------
+     *    T                 :   sample type; sets BitsPerSample and
+     *                          SampleFormat
+     *    data              :   height*width*samples_per_pixel samples,
+     *                          row after row, with the samples of each
+     *                          pixel together
+     *    height, width     :   size of the frame in pixels
+     *    samples_per_pixel :   number of samples in each pixel
+    */
+    template <typename T>
+    void write_frame(const T* data, int height, int width, int samples_per_pixel = 1){
+        if(!file.is_open()){
+            throw std::runtime_error(std::string("cannot write to closed file ") + path);
+        }
+        if((height<=0) || (width<=0) || (samples_per_pixel<=0) || (samples_per_pixel>65535)){
+            throw std::runtime_error(
+                std::string("invalid frame shape ") + std::to_string(height) + "x"
+                + std::to_string(width) + "x" + std::to_string(samples_per_pixel)
+            );
+        }
+        const uint64_t row_size = static_cast<uint64_t>(width)
+            * static_cast<uint64_t>(samples_per_pixel) * sizeof(T);
+        uint64_t rows = static_cast<uint64_t>(rows_per_strip);
+        if(rows==0){
+            rows = std::max<uint64_t>(DEFAULT_STRIP_BYTES / row_size, 1);
+        }
+        rows = std::min(rows, static_cast<uint64_t>(height));
+        const uint64_t n_strips = (static_cast<uint64_t>(height) + rows - 1) / rows;
+        const uint64_t frame_size = row_size * static_cast<uint64_t>(height);
+        if((compression==COMPRESSION_DEFLATE) && (rows*row_size>0xFFFFFFFFull)){
+            throw std::runtime_error("strips must be smaller than 4 GB to compress them");
+        }
+
+        IFD ifd;
+        ifd.width = width;
+        ifd.height = height;
+        ifd.bits_per_sample = static_cast<int>(8 * sizeof(T));
+        ifd.compression = compression;
+        ifd.samples_per_pixel = samples_per_pixel;
+        ifd.photometric_interpretation = ((samples_per_pixel==3) || (samples_per_pixel==4))
+            ? PHOTOMETRIC_RGB : PHOTOMETRIC_MINISBLACK;
+        ifd.rows_per_strip = static_cast<int>(rows);
+        ifd.sample_format = sample_format_of<T>();
+        ifd.strip_byte_counts.resize(n_strips);
+        const char* bytes = reinterpret_cast<const char*>(data);
+
+        // Compress every strip of the frame before writing any
+        if(compression==COMPRESSION_DEFLATE){
+            strip_buffers.resize(std::max<size_t>(strip_buffers.size(), n_strips));
+            auto compress_strip = [&](size_t strip){
+                const uint64_t start = strip * rows * row_size;
+                const uint64_t size = std::min(rows * row_size, frame_size - start);
+                std::unique_ptr<DEFLATECompressor> compressor = take_compressor();
+                if(compressor->compress(bytes + start, static_cast<unsigned>(size), strip_buffers[strip])!=Z_OK){
+                    throw std::runtime_error(
+                        std::string("failed to compress strip ") + std::to_string(strip)
+                        + std::string(" of frame ") + std::to_string(ifds.size())
+                    );
+                }
+                return_compressor(std::move(compressor));
+            };
+            if(pool && (n_strips>1)){
+                pool->parallel_for(static_cast<size_t>(n_strips), compress_strip);
+            } else{
+                for(size_t strip=0; strip<n_strips; ++strip){
+                    compress_strip(strip);
+                }
+            }
+            for(uint64_t strip=0; strip<n_strips; ++strip){
+                ifd.strip_byte_counts[strip] = strip_buffers[strip].size();
+            }
+        } else{
+            for(uint64_t strip=0; strip<n_strips; ++strip){
+                ifd.strip_byte_counts[strip] = std::min(rows * row_size, frame_size - strip*rows*row_size);
+            }
+        }
+
+        // Convert to BigTIFF if this frame would take the file past 4 GB
+        uint64_t data_size = 0;
+        for(uint64_t count : ifd.strip_byte_counts){
+            data_size += count;
+        }
+        ifd.strip_offsets.assign(n_strips, 0);
+        if((!big_tiff) && (file_end + 1 + data_size + 1 + ifd_size(ifd) > 0xFFFFFFFFull)){
+            convert_to_big_tiff();
+        }
+
+        align();
+        for(uint64_t strip=0; strip<n_strips; ++strip){
+            ifd.strip_offsets[strip] = file_end;
+            if(compression==COMPRESSION_DEFLATE){
+                append(strip_buffers[strip].data(), strip_buffers[strip].size());
+            } else{
+                append(bytes + strip*rows*row_size, ifd.strip_byte_counts[strip]);
+            }
+        }
+        write_ifd(ifd);
+        ifds.push_back(std::move(ifd));
+    }
+
+    /*
+     *  Method: close
+     *  -------------
+     *  Flush and close the file. Further calls do nothing.
+    */
+    void close(){
+        if(!file.is_open()){
+            return;
+        }
+        file.close();
+        if(!file){
+            throw std::runtime_error(std::string("failed to write to ") + path);
+        }
+    }
+
+    /* Getters */
+    uint64_t get_n_frames() const{return ifds.size();}
+    bool is_big_tiff() const{return big_tiff;}
+    const std::string& get_path() const{return path;}
+};
+
+} // end namespace pitifful
+
+#endif
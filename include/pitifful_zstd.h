@@ -0,0 +1,73 @@
+/* Zstandard decompression for pitifful (optional; needs libzstd) */
+#ifndef _PITIFFUL_ZSTD_H
+#define _PITIFFUL_ZSTD_H
+
+#include <iostream>
+#if defined(PITIFFUL_HAVE_ZSTD)
+#  include <zstd.h>
+#endif
+
+namespace pitifful {
+
+/* Indicates Zstandard compression (not part of TIFF6; assigned by libtiff) */
+static const int COMPRESSION_ZSTD = 50000;
+
+#if defined(PITIFFUL_HAVE_ZSTD)
+
+/*
+ *  Class: ZSTDDecompressor
+ *  -----------------------
+ *  Decompresses Zstandard strips (TIFF compression 50000), each of
+ *  which is a single Zstandard frame. The decompression context is
+ *  allocated on first use and reused for every later strip, so a single
+ *  instance should be kept per decoding thread.
+ *
+ *  Only compiled when PITIFFUL_HAVE_ZSTD is defined (and libzstd linked).
+*/
+class ZSTDDecompressor {
+    ZSTD_DCtx* dctx;
+public:
+    ZSTDDecompressor(): dctx(nullptr) {}
+    ~ZSTDDecompressor(){
+        if(dctx){
+            ZSTD_freeDCtx(dctx);
+        }
+    }
+    ZSTDDecompressor(const ZSTDDecompressor&) = delete;
+    ZSTDDecompressor& operator=(const ZSTDDecompressor&) = delete;
+
+    /*
+     *  Decompress *to_read* bytes held in memory into *out*, which has
+     *  room for *max* bytes. Returns true on success, in which case
+     *  *written* holds the decompressed size.
+    */
+    bool decompress(
+        const char* in,
+        unsigned to_read,
+        char* out,
+        unsigned& written,
+        unsigned max
+    ){
+        written = 0;
+        if(!dctx){
+            dctx = ZSTD_createDCtx();
+            if(!dctx){
+                std::cerr << "error with ZSTD_createDCtx\n";
+                return false;
+            }
+        }
+        const size_t ret = ZSTD_decompressDCtx(dctx, out, max, in, to_read);
+        if(ZSTD_isError(ret)){
+            std::cerr << "error with ZSTD_decompressDCtx: " << ZSTD_getErrorName(ret) << "\n";
+            return false;
+        }
+        written = static_cast<unsigned>(ret);
+        return true;
+    }
+};
+
+#endif // PITIFFUL_HAVE_ZSTD
+
+} // end namespace pitifful
+
+#endif
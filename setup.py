@@ -1,13 +1,46 @@
 """Compile pitifful Python bindings"""
+import ctypes.util
+import os
+import sys
 from setuptools import setup
 from pybind11.setup_helpers import Pybind11Extension, build_ext
 
+define_macros = []
+libraries = ["z"]
+
+# PITIFFUL_USE_LIBDEFLATE=1 decodes DEFLATE strips with libdeflate
+if os.environ.get("PITIFFUL_USE_LIBDEFLATE", "0") == "1":
+    define_macros.append(("PITIFFUL_USE_LIBDEFLATE", "1"))
+    libraries.append("deflate")
+
+
+def have_zstd():
+    """True if the libzstd headers and library can be found"""
+    include_dirs = [
+        os.path.join(sys.prefix, "include"),
+        "/usr/local/include",
+        "/usr/include",
+        "/opt/homebrew/include",
+    ]
+    if not any(os.path.exists(os.path.join(d, "zstd.h")) for d in include_dirs):
+        return False
+    return ctypes.util.find_library("zstd") is not None
+
+
+# Zstandard-compressed TIFFs are read when libzstd is available. Set
+# PITIFFUL_USE_ZSTD=1 to require it, or PITIFFUL_USE_ZSTD=0 to skip it.
+use_zstd = os.environ.get("PITIFFUL_USE_ZSTD")
+if use_zstd == "1" or (use_zstd is None and have_zstd()):
+    define_macros.append(("PITIFFUL_HAVE_ZSTD", "1"))
+    libraries.append("zstd")
+
 ext_modules = [
     Pybind11Extension(
         "_pitifful",
         ["src/module.cpp"],
         include_dirs=["include"],
-        libraries=["z"],
+        libraries=libraries,
+        define_macros=define_macros,
         cxx_std=14,
     ),
 ]
@@ -1,57 +1,327 @@
 /* Python bindings for pitifful */
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <limits>
 #include <string>
+#include <thread>
+#include <vector>
 #include "pitifful.h"
+#include "pitifful_prefetch.h"
+#include "pitifful_writer.h"
 #include <pybind11/pybind11.h>
 #include <pybind11/numpy.h>
+#include <pybind11/stl.h>
 
 namespace py = pybind11;
 
+/*
+ *  Call fn(T()) with T the C++ type matching a numpy dtype.
+*/
+template <typename F>
+auto dispatch_dtype(const py::dtype& dtype, const F& fn) -> decltype(fn(uint8_t()))
+{
+    const char kind = dtype.kind();
+    const long itemsize = dtype.itemsize();
+    if((kind=='u') && (itemsize==1)){
+        return fn(uint8_t());
+    } else if((kind=='u') && (itemsize==2)){
+        return fn(uint16_t());
+    } else if((kind=='u') && (itemsize==4)){
+        return fn(uint32_t());
+    } else if((kind=='u') && (itemsize==8)){
+        return fn(uint64_t());
+    } else if((kind=='i') && (itemsize==1)){
+        return fn(int8_t());
+    } else if((kind=='i') && (itemsize==2)){
+        return fn(int16_t());
+    } else if((kind=='i') && (itemsize==4)){
+        return fn(int32_t());
+    } else if((kind=='i') && (itemsize==8)){
+        return fn(int64_t());
+    } else if((kind=='f') && (itemsize==4)){
+        return fn(float());
+    } else if((kind=='f') && (itemsize==8)){
+        return fn(double());
+    }
+    throw std::runtime_error(
+        std::string("unsupported dtype kind '") + kind
+        + std::string("' with ") + std::to_string(itemsize) + " bytes per item"
+    );
+}
+
+/*
+ *  Call fn(T()) with T the type of the samples stored in the file for
+ *  *ifd*, as in pitifful::TIFFReader::decodes_in_place.
+*/
+template <typename F>
+auto dispatch_file_type(const pitifful::IFD& ifd, const F& fn) -> decltype(fn(uint8_t()))
+{
+    const bool is_int = ifd.sample_format==pitifful::SAMPLE_FORMAT_INT;
+    switch(ifd.bits_per_sample){
+        case 8:
+            return is_int ? fn(int8_t()) : fn(uint8_t());
+        case 16:
+            return is_int ? fn(int16_t()) : fn(uint16_t());
+        case 32:
+            if(ifd.sample_format==pitifful::SAMPLE_FORMAT_IEEEFP){
+                return fn(float());
+            }
+            return is_int ? fn(int32_t()) : fn(uint32_t());
+        case 64:
+            if(is_int){
+                return fn(int64_t());
+            } else if(ifd.sample_format==pitifful::SAMPLE_FORMAT_UINT){
+                return fn(uint64_t());
+            }
+            return fn(double());
+        default:
+            throw std::runtime_error(
+                std::string("no numpy dtype for ") + std::to_string(ifd.bits_per_sample)
+                + std::string("-bit samples")
+            );
+    }
+}
+
+/*
+ *  Call fn(T()) with the sample type a generic read should produce:
+ *  *dtype* if given, otherwise the dtype of *out* if given, otherwise
+ *  the type stored in the file for *ifd*.
+*/
+template <typename F>
+py::array dispatch_read_type(
+    const pitifful::IFD& ifd,
+    const py::object& dtype,
+    const py::object& out,
+    const F& fn
+){
+    if(!dtype.is_none()){
+        return dispatch_dtype(py::dtype::from_args(dtype), fn);
+    }
+    if(!out.is_none()){
+        if(!py::isinstance<py::array>(out)){
+            throw std::runtime_error("out must be a numpy array");
+        }
+        return dispatch_dtype(py::reinterpret_borrow<py::array>(out).dtype(), fn);
+    }
+    return dispatch_file_type(ifd, fn);
+}
+
+/*
+ *  Return *out* as the destination for a read of samples of type T, after
+ *  checking that it has that dtype, is writable and C-contiguous, and
+ *  holds exactly as many samples as *shape*. If *out* is None, allocate
+ *  a new array of that shape instead.
+*/
+template <typename T>
+py::array_t<T> output_array(const py::object& out, const std::vector<py::ssize_t>& shape)
+{
+    if(out.is_none()){
+        return py::array_t<T>(shape);
+    }
+    if(!py::isinstance<py::array_t<T>>(out)){
+        throw std::runtime_error("out does not have the requested dtype");
+    }
+    py::array_t<T> array = py::reinterpret_borrow<py::array_t<T>>(out);
+    py::ssize_t size = 1;
+    for(py::ssize_t n : shape){
+        size *= n;
+    }
+    if(!array.writeable()){
+        throw std::runtime_error("out is read-only");
+    }
+    if(!(array.flags() & py::detail::npy_api::NPY_ARRAY_C_CONTIGUOUS_)){
+        throw std::runtime_error("out must be C-contiguous");
+    }
+    if(array.size()!=size){
+        throw std::runtime_error(
+            std::string("out has ") + std::to_string(array.size())
+            + std::string(" elements; expected ") + std::to_string(size)
+        );
+    }
+    return array;
+}
+
+/* Shape of a frame as a numpy array: (height, width[, samples_per_pixel]) */
+std::vector<py::ssize_t> frame_shape(const pitifful::IFD& ifd)
+{
+    std::vector<py::ssize_t> shape{ifd.height, ifd.width};
+    if(ifd.samples_per_pixel>1){
+        shape.push_back(ifd.samples_per_pixel);
+    }
+    return shape;
+}
+
+/*
+ *  Read a single frame as samples of type T, into *out* if it is not
+ *  None (see output_array).
+*/
+template <typename T>
+py::array_t<T> read_frame_as(pitifful::TIFFReader& reader, int frame, const py::object& out)
+{
+    py::array_t<T> array = output_array<T>(out, frame_shape(reader.get_ifd(frame)));
+    T* out_ptr = static_cast<T*>(array.request().ptr);
+    {
+        py::gil_scoped_release release;
+        reader.read_frame<T>(frame, out_ptr);
+    }
+    return array;
+}
+
+py::array read_frame(
+    pitifful::TIFFReader& reader,
+    int frame,
+    const py::object& dtype,
+    const py::object& out
+){
+    return dispatch_read_type(reader.get_ifd(frame), dtype, out, [&](auto sample){
+        return py::array(read_frame_as<decltype(sample)>(reader, frame, out));
+    });
+}
+
 py::array_t<uint8_t> read_frame_8bit(pitifful::TIFFReader& reader, int frame)
 {
-    const pitifful::IFD& ifd = reader.get_ifd(frame);
-    const int height = ifd.height;
-    const int width = ifd.width;
-    const int samples_per_pixel = ifd.samples_per_pixel;
-    py::array_t<uint8_t> out(height*width*samples_per_pixel);
-    uint8_t* out_ptr = static_cast<uint8_t*>(out.request().ptr);
-    reader.read_frame<uint8_t>(frame, out_ptr);
+    return read_frame_as<uint8_t>(reader, frame, py::none());
+}
+
+py::array_t<uint16_t> read_frame_16bit(pitifful::TIFFReader& reader, int frame)
+{
+    return read_frame_as<uint16_t>(reader, frame, py::none());
+}
+
+/*
+ *  Read a window of *height* rows and *width* columns, starting at
+ *  column *x0* and row *y0*, of a single frame. Only the strips or tiles
+ *  that overlap the window are decoded.
+*/
+template <typename T>
+py::array_t<T> read_region(
+    pitifful::TIFFReader& reader,
+    int frame,
+    uint64_t x0,
+    uint64_t y0,
+    uint64_t width,
+    uint64_t height
+){
+    const int samples_per_pixel = reader.get_ifd(frame).samples_per_pixel;
+    py::array_t<T> out(static_cast<size_t>(width * height * samples_per_pixel));
+    T* out_ptr = static_cast<T*>(out.request().ptr);
+    {
+        py::gil_scoped_release release;
+        reader.read_region<T>(frame, x0, y0, width, height, out_ptr);
+    }
+    const long rows = static_cast<long>(height);
+    const long cols = static_cast<long>(width);
     if(samples_per_pixel>1){
-        out.resize({height, width, samples_per_pixel});
+        out.resize({rows, cols, static_cast<long>(samples_per_pixel)});
     } else{
-        out.resize({height, width});
+        out.resize({rows, cols});
     }
     return out;
 }
 
-py::array_t<uint16_t> read_frame_16bit(pitifful::TIFFReader& reader, int frame)
-{
-    const pitifful::IFD& ifd = reader.get_ifd(frame);
-    const int height = ifd.height;
-    const int width = ifd.width;
-    const int samples_per_pixel = ifd.samples_per_pixel;
-    py::array_t<uint16_t> out(height*width*samples_per_pixel);
-    uint16_t* out_ptr = static_cast<uint16_t*>(out.request().ptr);
-    reader.read_frame<uint16_t>(frame, out_ptr);
+py::array_t<uint8_t> read_region_8bit(
+    pitifful::TIFFReader& reader,
+    int frame,
+    uint64_t x0,
+    uint64_t y0,
+    uint64_t width,
+    uint64_t height
+){
+    return read_region<uint8_t>(reader, frame, x0, y0, width, height);
+}
+
+py::array_t<uint16_t> read_region_16bit(
+    pitifful::TIFFReader& reader,
+    int frame,
+    uint64_t x0,
+    uint64_t y0,
+    uint64_t width,
+    uint64_t height
+){
+    return read_region<uint16_t>(reader, frame, x0, y0, width, height);
+}
+
+/*
+ *  Read the same window of each frame listed in *frames* into an array
+ *  of shape (len(frames), height, width[, samples_per_pixel]). Frames
+ *  are read in parallel on *n_threads* threads (0 means one per hardware
+ *  core), decoding only the strips or tiles that overlap the window.
+*/
+template <typename T>
+py::array_t<T> read_regions_as(
+    pitifful::TIFFReader& reader,
+    const std::vector<int>& frames,
+    uint64_t x0,
+    uint64_t y0,
+    uint64_t width,
+    uint64_t height,
+    int n_threads
+){
+    const int samples_per_pixel = frames.empty() ? 1 : reader.get_ifd(frames[0]).samples_per_pixel;
+    for(int frame : frames){
+        if(reader.get_ifd(frame).samples_per_pixel!=samples_per_pixel){
+            throw std::runtime_error("read_regions needs frames with the same samples per pixel");
+        }
+    }
+    std::vector<py::ssize_t> shape{
+        static_cast<py::ssize_t>(frames.size()),
+        static_cast<py::ssize_t>(height),
+        static_cast<py::ssize_t>(width)
+    };
     if(samples_per_pixel>1){
-        out.resize({height, width, samples_per_pixel});
-    } else{
-        out.resize({height, width});
+        shape.push_back(samples_per_pixel);
+    }
+    py::array_t<T> out(shape);
+    T* out_ptr = static_cast<T*>(out.request().ptr);
+    const size_t region_size = static_cast<size_t>(width * height * samples_per_pixel);
+    {
+        py::gil_scoped_release release;
+        if(n_threads<=0){
+            n_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        }
+        pitifful::ThreadPool pool(std::min(n_threads, std::max(static_cast<int>(frames.size()), 1)));
+        pool.parallel_for(frames.size(), [&](size_t i){
+            reader.read_region<T>(frames[i], x0, y0, width, height, out_ptr + i * region_size);
+        });
     }
     return out;
 }
 
-py::array_t<uint16_t> read_stack_16bit(pitifful::TIFFReader& reader)
-{
+py::array read_regions(
+    pitifful::TIFFReader& reader,
+    const std::vector<int>& frames,
+    uint64_t x0,
+    uint64_t y0,
+    uint64_t width,
+    uint64_t height,
+    const py::object& dtype,
+    int n_threads
+){
+    return dispatch_read_type(reader.get_ifd(frames.empty() ? 0 : frames[0]), dtype, py::none(), [&](auto sample){
+        return py::array(read_regions_as<decltype(sample)>(reader, frames, x0, y0, width, height, n_threads));
+    });
+}
+
+/*
+ *  Read every frame of a homogeneous stack into a single array, which
+ *  is *out* if it is not None (see output_array). Frames are decoded
+ *  without the GIL on *n_threads* threads (0 means one per hardware
+ *  core), each straight into its slice of the output array.
+*/
+template <typename T>
+py::array_t<T> read_stack_as(
+    pitifful::TIFFReader& reader,
+    int n_threads,
+    const py::object& out,
+    const char* name
+){
     const int n_frames = static_cast<int>(reader.get_n_frames());
     const pitifful::IFD& ifd0 = reader.get_ifd(0);
     const int height = ifd0.height;
     const int width = ifd0.width;
     const int samples_per_pixel = ifd0.samples_per_pixel;
     const int bits_per_sample = ifd0.bits_per_sample;
-    const int size = n_frames * height * width * samples_per_pixel;
-    py::array_t<uint16_t> out(size);
-    uint16_t* out_ptr = static_cast<uint16_t*>(out.request().ptr);
     for(int frame=0; frame<n_frames; ++frame){
         const pitifful::IFD& ifd = reader.get_ifd(frame);
         if(
@@ -61,51 +331,91 @@ py::array_t<uint16_t> read_stack_16bit(pitifful::TIFFReader& reader)
             || (ifd.bits_per_sample!=bits_per_sample)
         ){
             throw std::runtime_error(
-                "read_stack_16bit only compatible with homogeneous " \
+                std::string(name) + " only compatible with homogeneous " \
                 "image sizes"
             );
         }
-        reader.read_frame<uint16_t>(
-            frame,
-            out_ptr + frame * height * width * samples_per_pixel
-        );
     }
-    if(samples_per_pixel==1){
-        out.resize({n_frames, height, width});
-    } else{
-        out.resize({n_frames, height, width, samples_per_pixel});
+    const size_t frame_size = static_cast<size_t>(height) * width * samples_per_pixel;
+    std::vector<py::ssize_t> shape = frame_shape(ifd0);
+    shape.insert(shape.begin(), n_frames);
+    py::array_t<T> array = output_array<T>(out, shape);
+    T* out_ptr = static_cast<T*>(array.request().ptr);
+    {
+        py::gil_scoped_release release;
+        if(n_threads<=0){
+            n_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        }
+        pitifful::ThreadPool pool(std::min(n_threads, std::max(n_frames, 1)));
+        pool.parallel_for(static_cast<size_t>(n_frames), [&](size_t frame){
+            reader.read_frame<T>(
+                static_cast<int>(frame),
+                out_ptr + frame * frame_size
+            );
+        });
     }
-    return out;
+    return array;
 }
 
-py::array_t<uint8_t> read_stack_8bit(pitifful::TIFFReader& reader)
+py::array read_stack(
+    pitifful::TIFFReader& reader,
+    int n_threads,
+    const py::object& dtype,
+    const py::object& out
+){
+    return dispatch_read_type(reader.get_ifd(0), dtype, out, [&](auto sample){
+        return py::array(read_stack_as<decltype(sample)>(reader, n_threads, out, "read_stack"));
+    });
+}
+
+py::array_t<uint16_t> read_stack_16bit(pitifful::TIFFReader& reader, int n_threads)
 {
-    const int n_frames = static_cast<int>(reader.get_n_frames());
-    const pitifful::IFD& ifd0 = reader.get_ifd(0);
+    return read_stack_as<uint16_t>(reader, n_threads, py::none(), "read_stack_16bit");
+}
+
+py::array_t<uint8_t> read_stack_8bit(pitifful::TIFFReader& reader, int n_threads)
+{
+    return read_stack_as<uint8_t>(reader, n_threads, py::none(), "read_stack_8bit");
+}
+
+/*
+ *  Read the frames listed in *frames*, in that order, into a single
+ *  array with pitifful::TIFFReader::read_frame_batch. With io="uring"
+ *  the reads for all of them are in flight at once.
+*/
+template <typename T>
+py::array_t<T> read_frame_batch(
+    pitifful::TIFFReader& reader,
+    const std::vector<int>& frames,
+    const char* name
+){
+    const int n_frames = static_cast<int>(frames.size());
+    if(n_frames==0){
+        return py::array_t<T>(0);
+    }
+    const pitifful::IFD& ifd0 = reader.get_ifd(frames[0]);
     const int height = ifd0.height;
     const int width = ifd0.width;
     const int samples_per_pixel = ifd0.samples_per_pixel;
-    const int bits_per_sample = ifd0.bits_per_sample;
-    const int size = n_frames * height * width * samples_per_pixel;
-    py::array_t<uint8_t> out(size);
-    uint8_t* out_ptr = static_cast<uint8_t*>(out.request().ptr);
-    for(int frame=0; frame<n_frames; ++frame){
+    for(int frame : frames){
         const pitifful::IFD& ifd = reader.get_ifd(frame);
         if(
             (ifd.height!=height)
             || (ifd.width!=width)
             || (ifd.samples_per_pixel!=samples_per_pixel)
-            || (ifd.bits_per_sample!=bits_per_sample)
         ){
             throw std::runtime_error(
-                "read_stack_16bit only compatible with homogeneous " \
+                std::string(name) + " only compatible with homogeneous " \
                 "image sizes"
             );
         }
-        reader.read_frame<uint8_t>(
-            frame,
-            out_ptr + frame * height * width * samples_per_pixel
-        );
+    }
+    const size_t frame_size = static_cast<size_t>(height) * width * samples_per_pixel;
+    py::array_t<T> out(static_cast<size_t>(n_frames) * frame_size);
+    T* out_ptr = static_cast<T*>(out.request().ptr);
+    {
+        py::gil_scoped_release release;
+        reader.read_frame_batch<T>(frames.data(), n_frames, out_ptr);
     }
     if(samples_per_pixel==1){
         out.resize({n_frames, height, width});
@@ -115,6 +425,179 @@ py::array_t<uint8_t> read_stack_8bit(pitifful::TIFFReader& reader)
     return out;
 }
 
+py::array_t<uint8_t> read_frame_batch_8bit(pitifful::TIFFReader& reader, const std::vector<int>& frames)
+{
+    return read_frame_batch<uint8_t>(reader, frames, "read_frame_batch_8bit");
+}
+
+py::array_t<uint16_t> read_frame_batch_16bit(pitifful::TIFFReader& reader, const std::vector<int>& frames)
+{
+    return read_frame_batch<uint16_t>(reader, frames, "read_frame_batch_16bit");
+}
+
+/*
+ *  Return a read-only array over *count* frames starting at *first*,
+ *  pointing straight into the reader's memory mapping (see
+ *  pitifful::TIFFReader::view_frames). The array's base holds the file
+ *  source, so the mapping outlives the reader if the array does, like
+ *  np.memmap. With *stack*, the array has a leading frame axis. A
+ *  *count* of 0 gives an empty stack, whatever the file's layout.
+*/
+template <typename T>
+py::array view_frames(pitifful::TIFFReader& reader, int first, int count, bool stack)
+{
+    const pitifful::IFD& ifd = reader.get_ifd(first);
+    if(count<=0){
+        if(count<0){
+            throw std::runtime_error(
+                std::string("cannot view ") + std::to_string(count) + std::string(" frames")
+            );
+        }
+        std::vector<py::ssize_t> shape{0, ifd.height, ifd.width};
+        if(ifd.samples_per_pixel>1){
+            shape.push_back(ifd.samples_per_pixel);
+        }
+        return py::array_t<T>(shape);
+    }
+    uint64_t stride = 0;
+    const T* ptr = reader.view_frames<T>(first, count, stride);
+    if(!ptr){
+        throw std::runtime_error(
+            "frames can only be viewed in place when the reader uses io=\"mmap\" and " \
+            "they are uncompressed, untiled, in the host byte order, and evenly " \
+            "spaced in the file"
+        );
+    }
+    const py::ssize_t sample = static_cast<py::ssize_t>(sizeof(T));
+    const py::ssize_t pixel = sample * ifd.samples_per_pixel;
+    std::vector<py::ssize_t> shape, strides;
+    if(stack){
+        shape.push_back(count);
+        strides.push_back(static_cast<py::ssize_t>(stride));
+    }
+    shape.push_back(ifd.height);
+    strides.push_back(pixel * ifd.width);
+    shape.push_back(ifd.width);
+    strides.push_back(pixel);
+    if(ifd.samples_per_pixel>1){
+        shape.push_back(ifd.samples_per_pixel);
+        strides.push_back(sample);
+    }
+    py::capsule base(
+        new std::shared_ptr<pitifful::FileSource>(reader.get_source()),
+        [](void* source){delete static_cast<std::shared_ptr<pitifful::FileSource>*>(source);}
+    );
+    py::array out(py::dtype::of<T>(), shape, strides, ptr, base);
+    py::detail::array_proxy(out.ptr())->flags &= ~py::detail::npy_api::NPY_ARRAY_WRITEABLE_;
+    return out;
+}
+
+py::array view_frame(pitifful::TIFFReader& reader, int frame)
+{
+    return dispatch_file_type(reader.get_ifd(frame), [&](auto sample){
+        return view_frames<decltype(sample)>(reader, frame, 1, false);
+    });
+}
+
+py::array view_stack(pitifful::TIFFReader& reader, int first, int count)
+{
+    if(count<0){
+        count = static_cast<int>(reader.get_n_frames()) - first;
+    }
+    return dispatch_file_type(reader.get_ifd(first), [&](auto sample){
+        return view_frames<decltype(sample)>(reader, first, count, true);
+    });
+}
+
+/*
+ *  Python iterator over consecutive frames, which are read and decoded
+ *  on a background thread while the caller processes earlier ones (see
+ *  pitifful::FramePrefetcher). Each frame is copied out of the ring of
+ *  decode buffers into its own array, so arrays stay valid after the
+ *  iterator moves on.
+*/
+template <typename T>
+class FrameIterator {
+    pitifful::TIFFReader& reader;
+    pitifful::FramePrefetcher<T> prefetcher;
+public:
+    FrameIterator(pitifful::TIFFReader& reader, uint64_t depth, uint64_t start, int64_t stop):
+        reader(reader),
+        prefetcher(
+            reader,
+            depth,
+            start,
+            (stop<0) ? std::numeric_limits<uint64_t>::max() : static_cast<uint64_t>(stop)
+        )
+    {}
+
+    py::array_t<T> next(){
+        uint64_t frame = 0;
+        const T* data;
+        {
+            py::gil_scoped_release release;
+            data = prefetcher.next(frame);
+        }
+        if(!data){
+            throw py::stop_iteration();
+        }
+        const pitifful::IFD& ifd = reader.get_ifd(frame);
+        const int height = ifd.height;
+        const int width = ifd.width;
+        const int samples_per_pixel = ifd.samples_per_pixel;
+        py::array_t<T> out(height*width*samples_per_pixel);
+        std::memcpy(out.request().ptr, data, out.size()*sizeof(T));
+        if(samples_per_pixel>1){
+            out.resize({height, width, samples_per_pixel});
+        } else{
+            out.resize({height, width});
+        }
+        return out;
+    }
+};
+
+template <typename T>
+void bind_frame_iterator(py::module_& m, const char* name)
+{
+    py::class_<FrameIterator<T>>(m, name, py::module_local())
+        .def(
+            "__iter__",
+            [](FrameIterator<T>& it) -> FrameIterator<T>& {return it;},
+            py::return_value_policy::reference_internal
+        )
+        .def("__next__", &FrameIterator<T>::next);
+}
+
+/*
+ *  Append a (height, width) or (height, width, samples_per_pixel) array
+ *  to *writer* as one frame with samples of type T.
+*/
+template <typename T>
+void write_frame_as(pitifful::TIFFWriter& writer, py::array array)
+{
+    py::array_t<T, py::array::c_style | py::array::forcecast> data(array);
+    if((data.ndim()!=2) && (data.ndim()!=3)){
+        throw std::runtime_error(
+            "write_frame expects an array of shape (height, width) or " \
+            "(height, width, samples_per_pixel)"
+        );
+    }
+    const int height = static_cast<int>(data.shape(0));
+    const int width = static_cast<int>(data.shape(1));
+    const int samples_per_pixel = (data.ndim()==3) ? static_cast<int>(data.shape(2)) : 1;
+    const T* ptr = static_cast<const T*>(data.request().ptr);
+    py::gil_scoped_release release;
+    writer.write_frame<T>(ptr, height, width, samples_per_pixel);
+}
+
+/* Append an array to *writer*, keeping its sample type */
+void write_frame(pitifful::TIFFWriter& writer, py::array array)
+{
+    dispatch_dtype(array.dtype(), [&](auto sample){
+        write_frame_as<decltype(sample)>(writer, array);
+    });
+}
+
 PYBIND11_MODULE(_pitifful, m)
 {
     py::class_<pitifful::IFD>(m, "IFD", py::module_local())
@@ -158,6 +641,30 @@ PYBIND11_MODULE(_pitifful, m)
             "rows_per_strip",
             [](const pitifful::IFD& ifd){return ifd.rows_per_strip;}
         )
+        .def_property_readonly(
+            "predictor",
+            [](const pitifful::IFD& ifd){return ifd.predictor;}
+        )
+        .def_property_readonly(
+            "tile_width",
+            [](const pitifful::IFD& ifd){return ifd.tile_width;}
+        )
+        .def_property_readonly(
+            "tile_length",
+            [](const pitifful::IFD& ifd){return ifd.tile_length;}
+        )
+        .def_property_readonly(
+            "sample_format",
+            [](const pitifful::IFD& ifd){return ifd.sample_format;}
+        )
+        .def_property_readonly(
+            "dtype",
+            [](const pitifful::IFD& ifd){
+                return dispatch_file_type(ifd, [](auto sample){
+                    return py::dtype::of<decltype(sample)>();
+                });
+            }
+        )
         .def(
             "summary",
             [](const pitifful::IFD& ifd){
@@ -168,14 +675,120 @@ PYBIND11_MODULE(_pitifful, m)
                 std::cout << "compression:\t" << ifd.compression << "\n";
                 std::cout << "photometric_interpretation:\t" << ifd.photometric_interpretation << "\n";
                 std::cout << "rows_per_strip:\t" << ifd.rows_per_strip << "\n";
+                std::cout << "predictor:\t" << ifd.predictor << "\n";
+                std::cout << "tile_width:\t" << ifd.tile_width << "\n";
+                std::cout << "tile_length:\t" << ifd.tile_length << "\n";
+                std::cout << "sample_format:\t" << ifd.sample_format << "\n";
                 std::cout << "byte_offset:\t" << ifd.byte_offset << "\n";
                 std::cout << "next_byte_offset:\t" << ifd.next_byte_offset << "\n";
                 std::cout << "count:\t" << ifd.count << "\n";
             }
         );
 
+    bind_frame_iterator<uint8_t>(m, "FrameIterator8bit");
+    bind_frame_iterator<uint16_t>(m, "FrameIterator16bit");
+
+    py::class_<pitifful::TIFFWriter>(m, "TIFFWriter", py::module_local())
+        .def(
+            py::init([](
+                const char* path,
+                const std::string& compression,
+                int level,
+                int n_threads,
+                int rows_per_strip,
+                bool big_tiff
+            ){
+                pitifful::WriterOptions options;
+                options.deflate_level = level;
+                options.n_threads = n_threads;
+                options.rows_per_strip = rows_per_strip;
+                options.big_tiff = big_tiff;
+                if(compression=="none"){
+                    options.compression = pitifful::COMPRESSION_NONE;
+                } else if(compression=="deflate"){
+                    options.compression = pitifful::COMPRESSION_DEFLATE;
+                } else{
+                    throw std::runtime_error(
+                        std::string("unrecognized compression ") + compression
+                    );
+                }
+                return new pitifful::TIFFWriter(path, options);
+            }),
+            py::arg("path"),
+            py::arg("compression") = "none",
+            py::arg("level") = pitifful::WriterOptions().deflate_level,
+            py::arg("n_threads") = 1,
+            py::arg("rows_per_strip") = 0,
+            py::arg("big_tiff") = false
+        )
+        .def_property_readonly("n_frames", &pitifful::TIFFWriter::get_n_frames)
+        .def_property_readonly("big_tiff", &pitifful::TIFFWriter::is_big_tiff)
+        .def("write_frame", &write_frame, py::arg("array"))
+        .def("close", &pitifful::TIFFWriter::close)
+        .def(
+            "__enter__",
+            [](pitifful::TIFFWriter& writer) -> pitifful::TIFFWriter& {return writer;},
+            py::return_value_policy::reference_internal
+        )
+        .def(
+            "__exit__",
+            [](pitifful::TIFFWriter& writer, py::object, py::object, py::object){
+                writer.close();
+            }
+        );
+
     py::class_<pitifful::TIFFReader>(m, "TIFFReader", py::module_local())
-        .def(py::init<const char*>())
+        .def(
+            py::init([](
+                const char* path,
+                const std::string& io,
+                int n_threads,
+                bool lazy,
+                bool use_index,
+                const std::string& index_path,
+                uint64_t tile_cache_bytes,
+                uint64_t coalesce_bytes,
+                unsigned io_queue_depth,
+                uint64_t frame_cache_bytes,
+                bool collect_stats
+            ){
+                pitifful::ReaderOptions options;
+                options.n_threads = n_threads;
+                options.lazy = lazy;
+                options.use_index = use_index;
+                options.index_path = index_path;
+                options.tile_cache_bytes = tile_cache_bytes;
+                options.coalesce_bytes = coalesce_bytes;
+                options.io_queue_depth = io_queue_depth;
+                options.frame_cache_bytes = frame_cache_bytes;
+                options.collect_stats = collect_stats;
+                if(io=="stream"){
+                    options.io_mode = pitifful::IO_STREAM;
+                } else if(io=="mmap"){
+                    options.io_mode = pitifful::IO_MMAP;
+                } else if(io=="pread"){
+                    options.io_mode = pitifful::IO_PREAD;
+                } else if(io=="uring"){
+                    options.io_mode = pitifful::IO_URING;
+                } else{
+                    throw std::runtime_error(
+                        std::string("unrecognized io mode ") + io
+                    );
+                }
+                return new pitifful::TIFFReader(path, options);
+            }),
+            py::arg("path"),
+            py::arg("io") = "stream",
+            py::arg("n_threads") = 1,
+            py::arg("lazy") = false,
+            py::arg("use_index") = false,
+            py::arg("index_path") = "",
+            py::arg("tile_cache_bytes") = 0,
+            py::arg("coalesce_bytes") = pitifful::ReaderOptions().coalesce_bytes,
+            py::arg("io_queue_depth") = pitifful::ReaderOptions().io_queue_depth,
+            py::arg("frame_cache_bytes") = 0,
+            py::arg("collect_stats") = false
+        )
         .def_property_readonly(
             "n_frames",
             &pitifful::TIFFReader::get_n_frames
@@ -184,10 +797,136 @@ PYBIND11_MODULE(_pitifful, m)
             "max_strip_size",
             &pitifful::TIFFReader::get_max_strip_size
         )
+        .def_property(
+            "n_threads",
+            &pitifful::TIFFReader::get_n_threads,
+            &pitifful::TIFFReader::set_n_threads
+        )
+        .def_property(
+            "coalesce_bytes",
+            &pitifful::TIFFReader::get_coalesce_bytes,
+            &pitifful::TIFFReader::set_coalesce_bytes
+        )
+        .def_property_readonly(
+            "tile_cache_hits",
+            [](pitifful::TIFFReader& reader){return reader.get_tile_cache().get_hits();}
+        )
+        .def_property_readonly(
+            "tile_cache_misses",
+            [](pitifful::TIFFReader& reader){return reader.get_tile_cache().get_misses();}
+        )
+        .def_property(
+            "frame_cache_bytes",
+            [](pitifful::TIFFReader& reader){return reader.get_frame_cache().get_capacity();},
+            [](pitifful::TIFFReader& reader, uint64_t bytes){reader.get_frame_cache().set_capacity(bytes);}
+        )
+        .def_property_readonly(
+            "frame_cache_size",
+            [](pitifful::TIFFReader& reader){return reader.get_frame_cache().get_size();}
+        )
+        .def_property_readonly(
+            "frame_cache_hits",
+            [](pitifful::TIFFReader& reader){return reader.get_frame_cache().get_hits();}
+        )
+        .def_property_readonly(
+            "frame_cache_misses",
+            [](pitifful::TIFFReader& reader){return reader.get_frame_cache().get_misses();}
+        )
+        .def_property(
+            "collect_stats",
+            &pitifful::TIFFReader::get_collect_stats,
+            &pitifful::TIFFReader::set_collect_stats
+        )
+        .def_property_readonly(
+            "stats",
+            [](const pitifful::TIFFReader& reader){
+                const pitifful::ReaderStats stats = reader.get_stats();
+                py::dict out;
+                out["read_calls"] = stats.read_calls;
+                out["read_bytes"] = stats.read_bytes;
+                out["read_ns"] = stats.read_ns;
+                out["mapped_bytes"] = stats.mapped_bytes;
+                out["decompress_calls"] = stats.decompress_calls;
+                out["compressed_bytes"] = stats.compressed_bytes;
+                out["decompressed_bytes"] = stats.decompressed_bytes;
+                out["decompress_ns"] = stats.decompress_ns;
+                out["converted_samples"] = stats.converted_samples;
+                out["convert_ns"] = stats.convert_ns;
+                return out;
+            }
+        )
+        .def("reset_stats", &pitifful::TIFFReader::reset_stats)
         .def("get_ifd", &pitifful::TIFFReader::get_ifd)
         .def("get_n_samples", &pitifful::TIFFReader::get_n_samples)
+        .def(
+            "read_frame",
+            &read_frame,
+            py::arg("frame"),
+            py::arg("dtype") = py::none(),
+            py::arg("out") = py::none()
+        )
         .def("read_frame_8bit", &read_frame_8bit)
         .def("read_frame_16bit", &read_frame_16bit)
-        .def("read_stack_8bit", &read_stack_8bit)
-        .def("read_stack_16bit", &read_stack_16bit);
+        .def(
+            "read_region_8bit",
+            &read_region_8bit,
+            py::arg("frame"),
+            py::arg("x0"),
+            py::arg("y0"),
+            py::arg("width"),
+            py::arg("height")
+        )
+        .def(
+            "read_region_16bit",
+            &read_region_16bit,
+            py::arg("frame"),
+            py::arg("x0"),
+            py::arg("y0"),
+            py::arg("width"),
+            py::arg("height")
+        )
+        .def(
+            "read_stack",
+            &read_stack,
+            py::arg("n_threads") = 0,
+            py::arg("dtype") = py::none(),
+            py::arg("out") = py::none()
+        )
+        .def(
+            "read_regions",
+            &read_regions,
+            py::arg("frames"),
+            py::arg("x0"),
+            py::arg("y0"),
+            py::arg("width"),
+            py::arg("height"),
+            py::arg("dtype") = py::none(),
+            py::arg("n_threads") = 0
+        )
+        .def("read_stack_8bit", &read_stack_8bit, py::arg("n_threads") = 0)
+        .def("read_stack_16bit", &read_stack_16bit, py::arg("n_threads") = 0)
+        .def("view_frame", &view_frame, py::arg("frame"))
+        .def("view_stack", &view_stack, py::arg("first") = 0, py::arg("count") = -1)
+        .def("read_frame_batch_8bit", &read_frame_batch_8bit, py::arg("frames"))
+        .def("read_frame_batch_16bit", &read_frame_batch_16bit, py::arg("frames"))
+        .def(
+            "iter_frames_8bit",
+            [](pitifful::TIFFReader& reader, uint64_t depth, uint64_t start, int64_t stop){
+                return new FrameIterator<uint8_t>(reader, depth, start, stop);
+            },
+            py::arg("depth") = 4,
+            py::arg("start") = 0,
+            py::arg("stop") = -1,
+            py::keep_alive<0, 1>()
+        )
+        .def(
+            "iter_frames_16bit",
+            [](pitifful::TIFFReader& reader, uint64_t depth, uint64_t start, int64_t stop){
+                return new FrameIterator<uint16_t>(reader, depth, start, stop);
+            },
+            py::arg("depth") = 4,
+            py::arg("start") = 0,
+            py::arg("stop") = -1,
+            py::keep_alive<0, 1>()
+        );
 }
@@ -1 +1,2 @@
 from _pitifful import *
+from .stack import TIFFStack
@@ -0,0 +1,186 @@
+"""Lazy, array-like access to the frames of a TIFF"""
+import operator
+import numpy as np
+from _pitifful import TIFFReader
+
+
+class TIFFStack:
+    """
+    Array-like view of a multi-frame TIFF with shape (n_frames, height,
+    width) or (n_frames, height, width, samples_per_pixel).
+
+    Nothing is read until the stack is indexed. Each lookup reads only the
+    frames it selects and, within those frames, only the strips or tiles
+    that overlap the bounding box of the selected rows and columns. Frames
+    are read in parallel on *n_threads* threads (0 means one per core).
+
+    Indices may be ints, slices, Ellipsis, or 1D integer or boolean arrays,
+    and give the same result as indexing the whole stack in memory. Index
+    arrays on the row and column axes read the bounding box of the rows
+    and columns they select.
+
+    Parameters
+    ----------
+        source      :   path to a TIFF, or an open TIFFReader
+        dtype       :   numpy dtype of the values returned; by default
+                        the type stored in the file
+        n_threads   :   threads used to read frames in parallel
+        **kwargs    :   passed to TIFFReader if *source* is a path
+    """
+    def __init__(self, source, dtype=None, n_threads=0, **kwargs):
+        if isinstance(source, TIFFReader):
+            self.reader = source
+        else:
+            self.reader = TIFFReader(str(source), **kwargs)
+        self.n_threads = n_threads
+        ifd = self.reader.get_ifd(0)
+        self.dtype = np.dtype(ifd.dtype if dtype is None else dtype)
+        self.shape = (self.reader.n_frames, ifd.height, ifd.width)
+        if ifd.samples_per_pixel > 1:
+            self.shape += (ifd.samples_per_pixel,)
+
+    @property
+    def ndim(self):
+        return len(self.shape)
+
+    @property
+    def size(self):
+        return int(np.prod(self.shape))
+
+    @property
+    def nbytes(self):
+        return self.size * self.dtype.itemsize
+
+    def __len__(self):
+        return self.shape[0]
+
+    def __repr__(self):
+        return "TIFFStack(shape={}, dtype={})".format(self.shape, self.dtype)
+
+    def __iter__(self):
+        for frame in range(len(self)):
+            yield self[frame]
+
+    def __array__(self, dtype=None, copy=None):
+        out = self[...]
+        return out if dtype is None else out.astype(dtype, copy=False)
+
+    def __getitem__(self, key):
+        key = self._expand_key(key)
+        height, width = self.shape[1:3]
+
+        # Each selected frame is read once, so the frame axis of the block
+        # is indexed by each frame's position among those read
+        frames, frame_key = _frame_axis(key[0], self.shape[0])
+        y0, y1, y_key = _box_axis(key[1], height)
+        x0, x1, x_key = _box_axis(key[2], width)
+
+        block_shape = (len(frames), y1 - y0, x1 - x0) + self.shape[3:]
+        if 0 in block_shape:
+            block = np.empty(block_shape, dtype=self.dtype)
+        else:
+            block = self.reader.read_regions(
+                frames,
+                x0=x0,
+                y0=y0,
+                width=x1 - x0,
+                height=y1 - y0,
+                dtype=self.dtype,
+                n_threads=self.n_threads,
+            )
+        return block[(frame_key, y_key, x_key) + key[3:]]
+
+    def _expand_key(self, key):
+        """Return *key* as a tuple with one normalized index per axis"""
+        if not isinstance(key, tuple):
+            key = (key,)
+        n_ellipsis = sum(k is Ellipsis for k in key)
+        if n_ellipsis > 1:
+            raise IndexError("an index can only have a single ellipsis ('...')")
+        if n_ellipsis == 1:
+            i = next(i for i, k in enumerate(key) if k is Ellipsis)
+            fill = (slice(None),) * (self.ndim - len(key) + 1)
+            key = key[:i] + fill + key[i + 1 :]
+        if len(key) > self.ndim:
+            raise IndexError(
+                "too many indices for TIFFStack: stack is {}-dimensional, "
+                "but {} were indexed".format(self.ndim, len(key))
+            )
+        key = key + (slice(None),) * (self.ndim - len(key))
+        return tuple(_normalize_index(k, n) for k, n in zip(key, self.shape))
+
+
+def _normalize_index(index, size):
+    """
+    Return *index* into an axis of length *size* as a slice, an int in
+    [0, size), or a 1D array of ints in [0, size).
+    """
+    if isinstance(index, slice):
+        return index
+    if index is None:
+        raise IndexError("TIFFStack does not support np.newaxis")
+    if not isinstance(index, (np.ndarray, list, tuple)):
+        try:
+            index = operator.index(index)
+        except TypeError:
+            raise IndexError(
+                "only integers, slices, ellipsis and integer or boolean "
+                "arrays are valid indices"
+            )
+        if index < -size or index >= size:
+            raise IndexError(
+                "index {} is out of bounds for axis with size {}".format(index, size)
+            )
+        return index % size
+
+    index = np.asarray(index)
+    if index.dtype == np.bool_:
+        if index.shape != (size,):
+            raise IndexError(
+                "boolean index of shape {} does not match axis of size {}".format(
+                    index.shape, size
+                )
+            )
+        return np.flatnonzero(index)
+    if index.size == 0:
+        index = index.astype(np.intp)
+    if not np.issubdtype(index.dtype, np.integer):
+        raise IndexError("arrays used as indices must be of integer or boolean type")
+    if index.ndim != 1:
+        raise IndexError("TIFFStack only supports 1D index arrays")
+    if np.any((index < -size) | (index >= size)):
+        raise IndexError("index out of bounds for axis with size {}".format(size))
+    return index % size
+
+
+def _frame_axis(index, size):
+    """
+    Return the frames to read for *index* along the frame axis, and the
+    index to apply to the block of those frames.
+    """
+    if isinstance(index, slice):
+        return list(range(*index.indices(size))), slice(None)
+    if isinstance(index, np.ndarray):
+        frames, inverse = np.unique(index, return_inverse=True)
+        return frames.tolist(), inverse.reshape(index.shape)
+    return [index], 0
+
+
+def _box_axis(index, size):
+    """
+    Return the bounding range [lo, hi) of *index* along a row or column
+    axis, and the same index relative to lo.
+    """
+    if isinstance(index, slice):
+        r = range(*index.indices(size))
+        if len(r) == 0:
+            return 0, 0, slice(0, 0)
+        lo, hi = min(r[0], r[-1]), max(r[0], r[-1]) + 1
+        stop = r[-1] - lo + (1 if r.step > 0 else -1)
+        return lo, hi, slice(r[0] - lo, stop if stop >= 0 else None, r.step)
+    if isinstance(index, np.ndarray):
+        if index.size == 0:
+            return 0, 0, index
+        lo, hi = int(index.min()), int(index.max()) + 1
+        return lo, hi, index - lo
+    return index, index + 1, 0